@@ -0,0 +1,82 @@
+/*
+  Copyright (c) 2023 Masahiro Oono
+
+  C API for embedding haribote as a library.
+
+  Build main.c with -DHARIBOTE_LIB to get the library without main().
+  A program is compiled once by hrbCompile() and can then be executed any
+  number of times by hrbExec(). All programs share one set of variables,
+  in the same way as lines typed into the REPL do, so the host passes
+  inputs and reads results through hrbSetVar() and hrbGetVar().
+
+  To run many long-lived scripts in one thread, hrbSpawn() makes a script
+  with its own copy of the program's variables, and hrbResume() runs it for
+  a given number of instructions. A scheduler made by hrbNewScheduler()
+  resumes its scripts in turn with the same slice and calls the done
+  callback when a script ends. Switching scripts only copies variables.
+  Each script counts its instructions and running time over all of its
+  resumes, and the limits of hrbSetLimits() apply to those totals.
+
+  Output of print goes to the function given to hrbSetOutput(), and error
+  messages (compile errors, limits exceeded) go to hrbSetErrorOutput(), so
+  the library writes nothing to stdout once both are set. Errors never end
+  the process: hrbCompile() returns NULL, and hrbExec() and hrbResume()
+  return HRB_ERROR or HRB_LIMIT_EXCEEDED.
+  The library is not thread-safe.
+*/
+#ifndef HARIBOTE_H
+#define HARIBOTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define HRB_API __attribute__((visibility("default")))
+#else
+#define HRB_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum { HRB_OK = 0, HRB_ERROR = 1, HRB_LIMIT_EXCEEDED = 3, HRB_YIELD = 4 };
+
+typedef struct HrbProgram HrbProgram;
+typedef struct HrbScript HrbScript;
+typedef struct HrbScheduler HrbScheduler;
+
+// printとprintsの出力先、エラーの表示先（lenは末尾の改行を含む）
+typedef void (*HrbOutputFn)(const char *str, size_t len, void *ctx);
+
+// スクリプトが終わったときに呼ばれる（statusはHRB_OK, HRB_ERROR, HRB_LIMIT_EXCEEDED）
+typedef void (*HrbDoneFn)(HrbScript *script, int status, void *ctx);
+
+HRB_API HrbProgram *hrbCompile(const char *src); // コンパイルエラーならNULL
+HRB_API int hrbExec(HrbProgram *prog);           // HRB_OK, HRB_ERROR, HRB_LIMIT_EXCEEDED
+HRB_API void hrbFree(HrbProgram *prog);
+
+HRB_API void hrbSetVar(const char *name, intptr_t value);
+HRB_API intptr_t hrbGetVar(const char *name);
+
+HRB_API void hrbSetOutput(HrbOutputFn fn, void *ctx); // fnがNULLなら標準出力に戻す
+HRB_API void hrbSetErrorOutput(HrbOutputFn fn, void *ctx); // エラーの表示先（fnがNULLならhrbSetOutput()と同じ所）
+HRB_API void hrbSetLimits(intptr_t maxSteps, double maxSeconds); // 0なら無制限
+
+HRB_API HrbScript *hrbSpawn(HrbProgram *prog);                 // 変数はすべて0から始まる
+HRB_API int hrbResume(HrbScript *script, intptr_t maxSteps);   // 命令数を使い切ったらHRB_YIELD（上限は再開した分の合計で調べる）
+HRB_API void hrbSetScriptVar(HrbScript *script, const char *name, intptr_t value);
+HRB_API intptr_t hrbGetScriptVar(HrbScript *script, const char *name);
+HRB_API void hrbKill(HrbScript *script);
+
+HRB_API HrbScheduler *hrbNewScheduler(intptr_t sliceSteps, HrbDoneFn done, void *ctx);
+HRB_API void hrbSchedule(HrbScheduler *sched, HrbScript *script); // 待ち行列の最後に入れる
+HRB_API int hrbStep(HrbScheduler *sched);         // 1区切りだけ実行して、残りのスクリプト数を返す
+HRB_API void hrbRunScheduler(HrbScheduler *sched); // スクリプトがなくなるまで実行する
+HRB_API void hrbFreeScheduler(HrbScheduler *sched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,15 +10,66 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
 #include <time.h>
 #include <assert.h>
 #if defined(__APPLE__) || defined(__linux__)
 #include <unistd.h>
 #include <termios.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <signal.h>
 #endif
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/memfd.h>
+#endif
+#include "haribote.h"
 
 typedef unsigned char *String;
 
+/*
+  出力先
+
+  printとprintsの出力はoutput()に、エラーなどの診断はprintError()に渡す。
+  ライブラリとして使うときは、hrbSetOutput()とhrbSetErrorOutput()でホストの関数に送れる。
+  診断の送り先を決めていなければ、printの出力と同じ所に送る。
+*/
+HrbOutputFn outputFn; // NULLなら標準出力
+void *outputCtx;
+HrbOutputFn errorFn;  // NULLならoutput()と同じ
+void *errorCtx;
+
+void output(const char *str, size_t len)
+{
+  if (outputFn)
+    outputFn(str, len, outputCtx);
+  else
+    fwrite(str, 1, len, stdout);
+}
+
+void printError(const char *format, ...)
+{
+  char buf[256];
+  va_list ap;
+  va_start(ap, format);
+  int len = vsnprintf(buf, sizeof buf, format, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+  if (len >= (int) sizeof buf) { // 長すぎる分は切り捨てて、改行で終える
+    len = sizeof buf - 1;
+    buf[len - 1] = '\n';
+  }
+  if (errorFn)
+    errorFn(buf, len, errorCtx);
+  else
+    output(buf, len);
+}
+
 int loadText(String path, String text, int size)
 {
   unsigned char buf[1000];
@@ -33,7 +84,7 @@ int loadText(String path, String text, int size)
 
   FILE *fp = fopen(buf, "rt");
   if (fp == NULL) {
-    printf("Failed to open %s\n", path);
+    printError("Failed to open %s\n", path);
     return 1;
   }
 
@@ -48,44 +99,342 @@ String tokenStrs[MAX_TOKEN_CODE + 1];
 int    tokenLens[MAX_TOKEN_CODE + 1];
 
 intptr_t vars[MAX_TOKEN_CODE + 1];
+int nTokenCodes; // 登録済みのトークンの数
+int hasCompileError; // putIc()やgetTokenCode()などが見つけたコンパイルエラー（表示は済んでいる。compileStatements()が文ごとに調べる）
 
-int getTokenCode(String str, int len)
+enum { ExitSuccess, ExitFailure, ExitLimitExceeded = 3, ExitYield };
+
+/*
+  メモリの使用量
+
+  スクリプトから使うメモリ（配列、連想配列、初期化子、文字列リテラル）はすべてallocMem()などを通して
+  確保し、確保した場所の種類ごとに今の量、最大量、確保と解放の回数、解放されていないブロック数を数える。
+  memLimitを超える確保はせずにNULLを返すので、呼び出し側は実行を打ち切る（memoryLimitExceeded()）。
+  mallocなどが失敗したときもNULLを返し、isOutOfMemoryを立てておく。
+*/
+enum { MemArray, MemDynArray, MemMap, MemInit, MemSort, MemString, EndOfMemSites };
+
+typedef struct { const char *name; intptr_t current, peak, nAllocs, nFrees, nBlocks; } MemSite;
+
+MemSite memSites[EndOfMemSites] = {
+  [MemArray] = {"array"}, [MemDynArray] = {"dynamic array"}, [MemMap] = {"map"},
+  [MemInit] = {"initializer"}, [MemSort] = {"sort buffer"}, [MemString] = {"string"},
+};
+intptr_t memCurrent, memPeak; // 全体の今の量と最大量[byte]
+intptr_t memLimit;            // 全体の上限[byte]（0なら無制限）
+int isOutOfMemory;            // 最後の確保が、上限ではなくmallocなどの失敗でできなかった
+int isMemReport;
+
+// siteでsizeバイト増えた（減った）ことを記録する
+void countMem(int site, intptr_t size)
 {
-  static unsigned char tokenBuf[(MAX_TOKEN_CODE + 1) * 10];
-  static int nTokens = 0, unusedHead = 0; // 登録済みのトークンの数, 未使用領域へのポインタ
+  MemSite *m = &memSites[site];
+  m->current += size;
+  if (m->current > m->peak)
+    m->peak = m->current;
+  memCurrent += size;
+  if (memCurrent > memPeak)
+    memPeak = memCurrent;
+}
+
+// oldSizeバイトのpをsizeバイトに広げる（pがNULLなら新しく確保する）。上限を超えるならNULL
+void *reallocMem(int site, void *p, size_t oldSize, size_t size)
+{
+  isOutOfMemory = 0;
+  if (memLimit > 0 && memCurrent - (intptr_t) oldSize + (intptr_t) size > memLimit)
+    return NULL;
+  void *q = realloc(p, size);
+  if (q == NULL) {
+    isOutOfMemory = 1;
+    return NULL;
+  }
+  memSites[site].nAllocs++;
+  if (p == NULL)
+    memSites[site].nBlocks++;
+  countMem(site, (intptr_t) size - (intptr_t) oldSize);
+  return q;
+}
+
+void *allocMem(int site, size_t size)
+{
+  return reallocMem(site, NULL, 0, size);
+}
+
+// 0で埋めた領域を確保する（大きな配列では、触るまでページが割り当てられないcallocを使う）
+void *allocZeroedMem(int site, size_t size)
+{
+  isOutOfMemory = 0;
+  if (memLimit > 0 && memCurrent + (intptr_t) size > memLimit)
+    return NULL;
+  void *p = calloc(size, 1);
+  if (p == NULL) {
+    isOutOfMemory = 1;
+    return NULL;
+  }
+  memSites[site].nAllocs++;
+  memSites[site].nBlocks++;
+  countMem(site, size);
+  return p;
+}
+
+void freeMem(int site, void *p, size_t size)
+{
+  if (p == NULL)
+    return;
+  free(p);
+  memSites[site].nFrees++;
+  memSites[site].nBlocks--;
+  countMem(site, -(intptr_t) size);
+}
+
+/*
+  初期化子（int a[N] = {...};の値）
+
+  コンパイルした値はinitializersにつないでおき、プログラムと一緒に解放する（hrbCompile()は
+  プログラムに移し、compile()は前のプログラムの分を解放する）。命令はこれを指すだけなので、
+  ループを展開して命令が複製されても解放は1回で済む。
+
+  要素がSHARE_MIN_BYTES以上あって、要素数が定数の表は、値をmemfdへ書いておき、OpAryShareが
+  実行のたびにMAP_PRIVATEで写像する（shareArray()）。書き換えるまでページはすべての実行で共有され、
+  書き換えたページだけがコピーされる。小さい表と、memfdを使えない環境ではOpAryNewとOpAryInitでコピーする。
+*/
+#define SHARE_MIN_BYTES 4096
+
+typedef struct Initializer {
+  intptr_t *values, n; // OpAryInitがコピーする値（memfdに書いたときはNULL）
+  int fd;              // OpAryShareが写像するmemfd（なければ-1）
+  struct Initializer *next;
+} Initializer;
+
+Initializer *initializers; // コンパイルしているプログラムの初期化子
+
+// n個の値を書いたmemfdを返す（作れなければ-1）
+int newInitImage(intptr_t *values, intptr_t n)
+{
+  int fd = -1;
+#if defined(__linux__)
+  size_t size = n * sizeof(intptr_t);
+  if (memLimit > 0 && memCurrent + (intptr_t) size > memLimit)
+    return -1;
+  fd = syscall(__NR_memfd_create, "haribote-init", MFD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (write(fd, values, size) != (ssize_t) size) {
+    close(fd);
+    return -1;
+  }
+  memSites[MemInit].nAllocs++;
+  memSites[MemInit].nBlocks++;
+  countMem(MemInit, size);
+#endif
+  return fd;
+}
+
+// allocMem(MemInit)で確保したn個の値を引き取る（isSharedならmemfdに移す）
+Initializer *newInitializer(intptr_t *values, intptr_t n, int isShared)
+{
+  Initializer *init = malloc(sizeof(Initializer));
+  if (init == NULL) {
+    printError("Failed to allocate memory\n");
+    freeMem(MemInit, values, n * sizeof(intptr_t));
+    return NULL;
+  }
+  init->values = values;
+  init->n = n;
+  init->fd = isShared ? newInitImage(values, n) : -1;
+  if (init->fd >= 0) {
+    freeMem(MemInit, values, n * sizeof(intptr_t));
+    init->values = NULL;
+  }
+  init->next = initializers;
+  initializers = init;
+  return init;
+}
+
+void freeInitializers(Initializer *init)
+{
+  while (init != NULL) {
+    Initializer *next = init->next;
+    if (init->fd >= 0) {
+#if defined(__APPLE__) || defined(__linux__)
+      close(init->fd);
+#endif
+      memSites[MemInit].nFrees++;
+      memSites[MemInit].nBlocks--;
+      countMem(MemInit, -(intptr_t) (init->n * sizeof(intptr_t)));
+    }
+    else
+      freeMem(MemInit, init->values, init->n * sizeof(intptr_t));
+    free(init);
+    init = next;
+  }
+}
+
+int memoryLimitExceeded()
+{
+  if (isOutOfMemory) {
+    printError("Failed to allocate memory\n");
+    return ExitFailure;
+  }
+  printError("Memory limit exceeded: %ld bytes\n", (long) memLimit);
+  return ExitLimitExceeded;
+}
+
+void reportMemory()
+{
+  if (!isMemReport)
+    return;
+  fprintf(stderr, "%-14s %14s %14s %10s %10s %10s\n", "memory", "current", "peak", "allocs", "frees", "unreleased");
+  for (int site = 0; site < EndOfMemSites; ++site) {
+    MemSite *m = &memSites[site];
+    fprintf(stderr, "%-14s %14ld %14ld %10ld %10ld %10ld\n", m->name, (long) m->current, (long) m->peak, (long) m->nAllocs, (long) m->nFrees, (long) m->nBlocks);
+  }
+  fprintf(stderr, "%-14s %14ld %14ld\n", "total", (long) memCurrent, (long) memPeak);
+}
+
+/*
+  文字列リテラルの置き場
+
+  リテラルはすべて1つの領域に詰めて置く。各文字列の前には長さを、後ろには改行とNULを置くので、
+  printsは長さを数えずに1回の書き込みで済む。変数には本体の先頭アドレスを入れる。
+  同じリテラルはトークンコードが同じなので、1度しか置かれない。
+*/
+#define STRING_POOL_SIZE (64 * 1024)
+intptr_t stringPool[STRING_POOL_SIZE / sizeof(intptr_t)];
+int stringPoolHead; // 未使用領域の先頭（バイト単位）
+
+inline static intptr_t stringLength(intptr_t v)
+{
+  return ((intptr_t *) v)[-1];
+}
+
+inline static int isHexDigit(unsigned char ch)
+{
+  return ('0' <= ch && ch <= '9') || ('a' <= (ch | 0x20) && (ch | 0x20) <= 'f');
+}
+
+inline static int hexValue(unsigned char ch)
+{
+  return '0' <= ch && ch <= '9' ? ch - '0' : (ch | 0x20) - 'a' + 10;
+}
+
+// ファイル名などに使うため、末尾の改行を除いたNUL終端の文字列にする
+const char *cString(intptr_t v)
+{
+  static char buf[4096];
+  intptr_t len = stringLength(v);
+  if (len >= (intptr_t) sizeof buf)
+    len = sizeof buf - 1;
+  memcpy(buf, (char *) v, len);
+  buf[len] = 0;
+  return buf;
+}
+
+// ダブルクォートで囲まれたリテラルのエスケープシーケンスを処理して置き場に入れる
+intptr_t internString(String str, int len)
+{
+  if (len >= 2 && str[len - 1] == '"')
+    --len;
+  if (stringPoolHead + sizeof(intptr_t) + len + 2 > STRING_POOL_SIZE) {
+    printError("Too many strings\n");
+    hasCompileError = 1;
+    return 0;
+  }
+  unsigned char *head = (unsigned char *) stringPool + stringPoolHead;
+  unsigned char *p = head + sizeof(intptr_t);
+  for (int i = 1; i < len; ++i) {
+    if (str[i] != '\\' || i + 1 >= len) {
+      *p++ = str[i];
+      continue;
+    }
+    switch (str[++i]) {
+    case 'n': *p++ = '\n'; break;
+    case 't': *p++ = '\t'; break;
+    case 'r': *p++ = '\r'; break;
+    case '0': *p++ = 0;     break;
+    case 'x':
+      if (i + 2 < len && isHexDigit(str[i + 1]) && isHexDigit(str[i + 2])) {
+        *p++ = hexValue(str[i + 1]) * 16 + hexValue(str[i + 2]);
+        i += 2;
+        break;
+      }
+      // fallthrough
+    default:  *p++ = str[i]; break; // \\, \" など
+    }
+  }
+  intptr_t n = p - (head + sizeof(intptr_t));
+  memcpy(head, &n, sizeof n);
+  *p++ = '\n';
+  *p++ = 0;
+  int size = (p - head + sizeof(intptr_t) - 1) / sizeof(intptr_t) * sizeof(intptr_t);
+  stringPoolHead += size;
+  memSites[MemString].nAllocs++;
+  memSites[MemString].nBlocks++;
+  countMem(MemString, size);
+  return (intptr_t) (head + sizeof(intptr_t));
+}
+
+#define TOKEN_HASH_SIZE 4096 // 2のべき乗で、MAX_TOKEN_CODEの2倍以上
+int tokenHash[TOKEN_HASH_SIZE]; // トークンコード+1（0は空き）
+
+inline static unsigned tokenHashOf(String str, int len)
+{
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; ++i)
+    h = (h ^ str[i]) * 16777619u;
+  return h & (TOKEN_HASH_SIZE - 1);
+}
 
-  int i;
-  for (i = 0; i < nTokens; ++i) { // 登録済みのトークンコードの中から探す
+// 登録済みのトークンコードを返す（なければ-1）
+// 登録しないので、新しいトークンを登録していない間は複数のスレッドから呼んでもよい
+int findTokenCode(String str, int len)
+{
+  for (unsigned h = tokenHashOf(str, len); tokenHash[h] != 0; h = (h + 1) & (TOKEN_HASH_SIZE - 1)) {
+    int i = tokenHash[h] - 1;
     if (len == tokenLens[i] && strncmp(str, tokenStrs[i], len) == 0)
-      break;
+      return i;
   }
-  if (i == nTokens) {
-    if (nTokens >= MAX_TOKEN_CODE) {
-      printf("Too many tokens\n");
-      exit(1);
+  return -1;
+}
+
+// 登録できなければコンパイルエラーにして、どのトークンにも使わないMAX_TOKEN_CODEを返す
+int getTokenCode(String str, int len)
+{
+  static unsigned char tokenBuf[(MAX_TOKEN_CODE + 1) * 10];
+  static int unusedHead = 0; // 未使用領域へのポインタ
+
+  int i = findTokenCode(str, len); // 登録済みのトークンコードの中から探す
+  if (i < 0) {
+    i = nTokenCodes;
+    if (nTokenCodes >= MAX_TOKEN_CODE || unusedHead + len + 1 > (int) sizeof tokenBuf) {
+      printError("Too many tokens\n");
+      hasCompileError = 1;
+      return MAX_TOKEN_CODE;
     }
     strncpy(&tokenBuf[ unusedHead ], str, len); // 見つからなければ新規登録
     tokenBuf[ unusedHead + len ] = 0;
     tokenStrs[i] = &tokenBuf[ unusedHead ];
     tokenLens[i] = len;
     unusedHead += len + 1;
-    ++nTokens;
+    ++nTokenCodes;
+
+    unsigned h = tokenHashOf(str, len);
+    while (tokenHash[h] != 0)
+      h = (h + 1) & (TOKEN_HASH_SIZE - 1);
+    tokenHash[h] = i + 1;
 
     vars[i] = strtol(tokenStrs[i], NULL, 0); // 定数であれば初期値を設定（定数でなければ0になる）
-    if (tokenStrs[i][0] == '"') {
-      char *p = malloc(len - 1);
-      if (p == NULL) {
-        printf("Failed to allocate memory\n");
-        exit(1);
-      }
-      vars[i] = (intptr_t) p;
-      memcpy(p, tokenStrs[i] + 1, len - 2); // 手抜き実装（エスケープシーケンスを処理していない）
-      p[len - 2] = 0;
-    }
+    if (tokenStrs[i][0] == '"')
+      vars[i] = internString(tokenStrs[i], len);
   }
   return i;
 }
 
+inline static int isStringSlot(int i)
+{
+  return tokenStrs[i][0] == '"';
+}
+
 inline static int isAlphabet(unsigned char ch)
 {
   return ('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z') || ch == '_';
@@ -96,45 +445,216 @@ inline static int isNumber(unsigned char ch)
   return '0' <= ch && ch <= '9';
 }
 
-int lexer(String str, int *tc)
+int *tc; // トークンコード列を格納する
+int *tcLine; // トークンがあるソースの行（1から）
+int tcSize;
+
+// tcとtcLineをn個分に広げる（できなければ-1）
+int reserveTc(int n)
 {
-  int pos = 0, nTokens = 0; // 現在読んでいる位置, これまでに変換したトークンの数
-  int len;
-  for (;;) {
-    while (str[pos] == ' ' || str[pos] == '\t' || str[pos] == '\n' || str[pos] == '\r')
-      ++pos;
-    if (str[pos] == 0)
-      return nTokens;
-
-    len = 0;
-    if (strchr("(){}[];,", str[pos]) != NULL)
-      len = 1;
-    else if (isAlphabet(str[pos]) || isNumber(str[pos])) {
-      while (isAlphabet(str[pos + len]) || isNumber(str[pos + len]))
-        ++len;
-    }
-    else if (strchr("=+-*/!%&~|<>?:.#", str[pos]) != NULL) {
-      while (strchr("=+-*/!%&~|<>?:.#", str[pos + len]) != NULL && str[pos + len] != 0)
-        ++len;
-    }
-    else if (str[pos] == '"') { // 文字列
-      len = 1;
-      while (str[pos + len] != str[pos] && str[pos + len] >= ' ')
-        ++len;
-      if (str[pos + len] == str[pos])
-        ++len;
+  if (n <= tcSize)
+    return 0;
+  int size = tcSize ? tcSize : 10000;
+  while (size < n)
+    size *= 2;
+  int *p = realloc(tc, size * sizeof(int));
+  if (p != NULL)
+    tc = p;
+  int *q = p ? realloc(tcLine, size * sizeof(int)) : NULL;
+  if (q == NULL) {
+    printError("Failed to allocate memory\n");
+    return -1;
+  }
+  tcLine = q;
+  tcSize = size;
+  return 0;
+}
+
+// str[*from]からstr[to]の手前までの改行を*lineに足す
+inline static void countLines(String str, int *from, int to, int *line)
+{
+  for (int i = *from; i < to; ++i)
+    *line += str[i] == '\n';
+  *from = to;
+}
+
+// str[*pos]以降、endより前にある次のトークンの長さを返す（なければ0、読めない文字なら-1）
+// *posはトークンの先頭まで進める
+int nextToken(String str, int *pos, int end)
+{
+  int p = *pos, len = 0;
+  while (p < end && (str[p] == ' ' || str[p] == '\t' || str[p] == '\n' || str[p] == '\r'))
+    ++p;
+  *pos = p;
+  if (p >= end)
+    return 0;
+
+  if (strchr("(){}[];,", str[p]) != NULL)
+    len = 1;
+  else if (isAlphabet(str[p]) || isNumber(str[p])) {
+    while (isAlphabet(str[p + len]) || isNumber(str[p + len]))
+      ++len;
+  }
+  else if (strchr("=+-*/!%&~|<>?:.#", str[p]) != NULL) {
+    while (strchr("=+-*/!%&~|<>?:.#", str[p + len]) != NULL && str[p + len] != 0)
+      ++len;
+  }
+  else if (str[p] == '"') { // 文字列
+    len = 1;
+    while (str[p + len] != str[p] && str[p + len] >= ' ')
+      len += str[p + len] == '\\' && str[p + len + 1] >= ' ' ? 2 : 1; // \"は閉じない
+    if (str[p + len] == str[p])
+      ++len;
+  }
+  else
+    return -1;
+  return len;
+}
+
+/*
+  並列の字句解析
+
+  トークンは改行をまたがない（文字列も行末で終わる）ので、長いソースは行の切れ目で分けて、
+  スレッドごとにトークンの区切りを見つけ、登録済みのトークンコードを引いておく。
+  未登録のトークンはあとで先頭から順に登録するので、トークンコードは1スレッドで字句解析したときと同じになる。
+*/
+#if defined(__APPLE__) || defined(__linux__)
+#define PARALLEL_LEX_MIN (256 * 1024) // これより短いソースは1スレッドで字句解析する
+#define MAX_LEX_THREADS 16
+
+typedef struct {
+  String str;
+  int begin, end;      // 担当する範囲
+  int *pos, *code;     // トークンの位置と、トークンコード（未登録なら-1）
+  int n, size;
+  int errorPos;        // 読めない文字の位置（なければ-1）
+} LexSpan;
+
+void *lexSpan(void *arg)
+{
+  LexSpan *span = arg;
+  int pos = span->begin, len;
+  span->errorPos = -1;
+  while ((len = nextToken(span->str, &pos, span->end)) != 0) {
+    if (len < 0) {
+      span->errorPos = pos;
+      break;
     }
-    else {
-      printf("Lexing error: %.10s\n", &str[pos]);
-      exit(1);
+    if (span->n >= span->size) {
+      int size = span->size ? span->size * 2 : 4096, *p = realloc(span->pos, size * sizeof(int));
+      if (p != NULL)
+        span->pos = p;
+      int *q = p ? realloc(span->code, size * sizeof(int)) : NULL;
+      if (q == NULL) {
+        span->errorPos = -2;
+        break;
+      }
+      span->code = q;
+      span->size = size;
     }
-    tc[nTokens] = getTokenCode(&str[pos], len);
+    span->pos[span->n] = pos;
+    span->code[span->n] = findTokenCode(&span->str[pos], len);
+    ++span->n;
     pos += len;
-    ++nTokens;
   }
+  return NULL;
+}
+
+int lexerParallel(String str, int length, int nThreads)
+{
+  LexSpan spans[MAX_LEX_THREADS] = {0};
+  pthread_t threads[MAX_LEX_THREADS];
+  int isStarted[MAX_LEX_THREADS] = {0}, begin = 0;
+  for (int t = 0; t < nThreads; ++t) {
+    int end = t == nThreads - 1 ? length : (int) ((int64_t) length * (t + 1) / nThreads);
+    while (end < length && str[end - 1] != '\n') // 行の切れ目まで延ばす
+      ++end;
+    spans[t].str = str;
+    spans[t].begin = begin;
+    spans[t].end = begin = end;
+  }
+  for (int t = 1; t < nThreads; ++t)
+    isStarted[t] = pthread_create(&threads[t], NULL, lexSpan, &spans[t]) == 0;
+  for (int t = 0; t < nThreads; ++t) {
+    if (isStarted[t])
+      pthread_join(threads[t], NULL);
+    else
+      lexSpan(&spans[t]); // スレッドを作れなければ自分で処理する
+  }
+
+  int nTokens = 0, line = 1, linePos = 0;
+  for (int t = 0; t < nThreads && nTokens >= 0; ++t) { // 順番につなげ、未登録のトークンを登録する（エラーなら-1）
+    LexSpan *span = &spans[t];
+    if (reserveTc(nTokens + span->n + 5) < 0) {
+      nTokens = -1;
+      break;
+    }
+    for (int i = 0; i < span->n; ++i) {
+      int code = span->code[i];
+      if (code < 0) {
+        int pos = span->pos[i], len = nextToken(str, &pos, span->end);
+        if ((code = getTokenCode(&str[pos], len)) == MAX_TOKEN_CODE) {
+          nTokens = -1;
+          break;
+        }
+      }
+      countLines(str, &linePos, span->pos[i], &line);
+      tcLine[nTokens] = line;
+      tc[nTokens++] = code;
+    }
+    if (nTokens >= 0 && span->errorPos == -2) {
+      printError("Failed to allocate memory\n");
+      nTokens = -1;
+    }
+    else if (nTokens >= 0 && span->errorPos >= 0) {
+      printError("Lexing error: %.10s\n", &str[span->errorPos]);
+      nTokens = -1;
+    }
+  }
+  for (int t = 0; t < nThreads; ++t) {
+    free(spans[t].pos);
+    free(spans[t].code);
+  }
+  return nTokens;
 }
+#endif
+
+// tcにトークンコード列を入れ、トークンの数を返す（後ろに少なくとも5個分の空きを残す。エラーなら-1）
+int lexer(String str)
+{
+  int length = strlen(str);
+#if defined(__APPLE__) || defined(__linux__)
+  if (length >= PARALLEL_LEX_MIN) {
+    int nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nThreads > MAX_LEX_THREADS)
+      nThreads = MAX_LEX_THREADS;
+    if (nThreads > length / (PARALLEL_LEX_MIN / 4))
+      nThreads = length / (PARALLEL_LEX_MIN / 4);
+    if (nThreads > 1)
+      return lexerParallel(str, length, nThreads);
+  }
+#endif
 
-int tc[10000]; // トークンコード列を格納する
+  int pos = 0, nTokens = 0; // 現在読んでいる位置, これまでに変換したトークンの数
+  int len, line = 1, linePos = 0;
+  while ((len = nextToken(str, &pos, length)) != 0) {
+    if (len < 0) {
+      printError("Lexing error: %.10s\n", &str[pos]);
+      return -1;
+    }
+    if (reserveTc(nTokens + 5) < 0)
+      return -1;
+    countLines(str, &linePos, pos, &line);
+    tcLine[nTokens] = line;
+    if ((tc[nTokens] = getTokenCode(&str[pos], len)) == MAX_TOKEN_CODE)
+      return -1;
+    pos += len;
+    ++nTokens;
+  }
+  if (reserveTc(nTokens + 5) < 0)
+    return -1;
+  return nTokens;
+}
 
 enum {
   PlusPlus,
@@ -175,6 +695,23 @@ enum {
   Continue,
   Break,
   Prints,
+  Snapshot,
+  Int,
+  Const,
+  Mmap,
+  Input,
+  Push,
+  Pop,
+  Len,
+  Reserve,
+  MapKey,
+  Put,
+  Get,
+  Del,
+  Has,
+  Sort,
+  Timer,
+  Stop,
 
   Wildcard,
   Expr,
@@ -244,6 +781,23 @@ String defaultTokens[] = {
   "continue",
   "break",
   "prints",
+  "snapshot",
+  "int",
+  "const",
+  "mmap",
+  "input",
+  "push",
+  "pop",
+  "len",
+  "reserve",
+  "map",
+  "put",
+  "get",
+  "del",
+  "has",
+  "sort",
+  "timer",
+  "stop",
 
   "!!*",
   "!!**",
@@ -275,8 +829,11 @@ String defaultTokens[] = {
 void initTc(String *defaultTokens, int len)
 {
   assert(len == EndOfKeys);
-  for (int i = 0; i < len; ++i)
-    tc[i] = getTokenCode(defaultTokens[i], strlen(defaultTokens[i]));
+  for (int i = 0; i < len; ++i) {
+    int code = getTokenCode(defaultTokens[i], strlen(defaultTokens[i]));
+    assert(code == i); // enumの値がそのままトークンコードになる
+    (void) code;
+  }
 }
 
 typedef enum {
@@ -332,7 +889,122 @@ inline static Precedence getPrecedence(int style, int operator)
 
 #define MAX_PHRASE_LEN 31
 #define N_WILDCARDS 10
-int phraseTc[(MAX_PHRASE_LEN + 1) * 100]; // フレーズを字句解析して得たトークンコード列を格納する
+
+/*
+  フレーズ（構文のパターン）
+
+  パターンはコンパイル時にトークンコード列として用意しておくので、起動時に字句解析しなくてよい。
+  W(n)は「!!*n」（任意の1トークン）、E(n)は「!!**n」（式）、E0(n)は「!!***n」（空でもよい式）を表す。
+*/
+typedef enum {
+  PhParen,
+  PhPrefix,
+  PhPostfix,
+  PhArySet,
+  PhAryGet,
+  PhCpy,
+  PhIncJump,
+  PhInc,
+  PhArith,
+  PhPrint,
+  PhLabel,
+  PhGoto,
+  PhIfGoto,
+  PhTime,
+  PhTimer,
+  PhTimerStop,
+  PhTimerReport,
+  PhIf,
+  PhElse,
+  PhEnd,
+  PhFor,
+  PhWhile,
+  PhContinue,
+  PhBreak,
+  PhIfContinue,
+  PhIfBreak,
+  PhPrints,
+  PhSnapshot,
+  PhMmap,
+  PhConstMmap,
+  PhInputAry,
+  PhInput,
+  PhAryDyn,
+  PhPush,
+  PhReserve,
+  PhMapNew,
+  PhMapPut,
+  PhMapDel,
+  PhMapGet,
+  PhMapHas,
+  PhSort,
+  PhAryNew,
+  PhAryInit,
+  PhExpr,
+  EndOfPhrases
+} Phrase;
+typedef struct {
+  int len;
+  int tc[MAX_PHRASE_LEN];
+} PhraseTc;
+
+#define W(n)  Wildcard, Zero + (n)
+#define E(n)  Expr, Zero + (n)
+#define E0(n) Expr0, Zero + (n)
+#define PHRASE(...) {sizeof (int[]) {__VA_ARGS__} / sizeof(int), {__VA_ARGS__}}
+
+static const PhraseTc phrases[EndOfPhrases] = {
+  [PhParen]      = PHRASE(Lparen, E(0), Rparen), // ( !!**0 )
+  [PhPrefix]     = PHRASE(W(0), W(1), Lbracket, E(2), Rbracket), // !!*0!!*1[!!**2]
+  [PhPostfix]    = PHRASE(Lbracket, E(0), Rbracket, W(1)), // [!!**0]!!*1
+  [PhArySet]     = PHRASE(Lbracket, E(0), Rbracket, Assign), // [!!**0]=
+  [PhAryGet]     = PHRASE(Lbracket, E(0), Rbracket), // [!!**0]
+  [PhCpy]        = PHRASE(W(0), Assign, W(1), Semicolon), // !!*0 = !!*1;
+  [PhIncJump]    = PHRASE(W(0), Assign, W(1), Plus, One, Semicolon, If, Lparen, W(2), Les, W(3), Rparen, Goto, W(4), Semicolon), // !!*0 = !!*1 + 1; if (!!*2 < !!*3) goto !!*4;
+  [PhInc]        = PHRASE(W(0), Assign, W(1), Plus, One, Semicolon), // !!*0 = !!*1 + 1;
+  [PhArith]      = PHRASE(W(0), Assign, W(1), W(2), W(3), Semicolon), // !!*0 = !!*1 !!*2 !!*3;
+  [PhPrint]      = PHRASE(Print, E(0), Semicolon), // print !!**0;
+  [PhLabel]      = PHRASE(W(0), Colon), // !!*0:
+  [PhGoto]       = PHRASE(Goto, W(0), Semicolon), // goto !!*0;
+  [PhIfGoto]     = PHRASE(If, Lparen, E(0), Rparen, Goto, W(1), Semicolon), // if (!!**0) goto !!*1;
+  [PhTime]       = PHRASE(Time, Semicolon), // time;
+  [PhTimer]      = PHRASE(Timer, W(0), Semicolon), // timer !!*0;
+  [PhTimerStop]  = PHRASE(Stop, W(0), Semicolon), // stop !!*0;
+  [PhTimerReport] = PHRASE(Timer, Semicolon), // timer;
+  [PhIf]         = PHRASE(If, Lparen, E(0), Rparen, Lbrace), // if (!!**0) {
+  [PhElse]       = PHRASE(Rbrace, Else, Lbrace), // } else {
+  [PhEnd]        = PHRASE(Rbrace), // }
+  [PhFor]        = PHRASE(For, Lparen, E0(0), Semicolon, E0(1), Semicolon, E0(2), Rparen, Lbrace), // for (!!***0; !!***1; !!***2) {
+  [PhWhile]      = PHRASE(While, Lparen, E(1), Rparen, Lbrace), // while (!!**1) {
+  [PhContinue]   = PHRASE(Continue, Semicolon), // continue;
+  [PhBreak]      = PHRASE(Break, Semicolon), // break;
+  [PhIfContinue] = PHRASE(If, Lparen, E(0), Rparen, Continue, Semicolon), // if (!!**0) continue;
+  [PhIfBreak]    = PHRASE(If, Lparen, E(0), Rparen, Break, Semicolon), // if (!!**0) break;
+  [PhPrints]     = PHRASE(Prints, E(0), Semicolon), // prints !!**0;
+  [PhSnapshot]   = PHRASE(Snapshot, W(0), Semicolon), // snapshot !!*0;
+  [PhMmap]       = PHRASE(Int, W(0), Lbracket, W(1), Rbracket, Assign, Mmap, Lparen, W(2), Rparen, Semicolon), // int !!*0[!!*1] = mmap(!!*2);
+  [PhConstMmap]  = PHRASE(Const, Int, W(0), Lbracket, W(1), Rbracket, Assign, Mmap, Lparen, W(2), Rparen, Semicolon), // const int !!*0[!!*1] = mmap(!!*2);
+  [PhInputAry]   = PHRASE(Input, W(0), Lbracket, E(1), Rbracket, Comma, W(2), Semicolon), // input !!*0[!!**1], !!*2;
+  [PhInput]      = PHRASE(Input, W(0), Semicolon), // input !!*0;
+  [PhAryDyn]     = PHRASE(Int, W(0), Lbracket, Rbracket, Semicolon), // int !!*0[];
+  [PhPush]       = PHRASE(Push, W(0), Comma, E(1), Semicolon), // push !!*0, !!**1;
+  [PhReserve]    = PHRASE(Reserve, W(0), Comma, E(1), Semicolon), // reserve !!*0, !!**1;
+  [PhMapNew]     = PHRASE(MapKey, W(0), Semicolon), // map !!*0;
+  [PhMapPut]     = PHRASE(Put, W(0), Comma, E(1), Comma, E(2), Semicolon), // put !!*0, !!**1, !!**2;
+  [PhMapDel]     = PHRASE(Del, W(0), Comma, E(1), Semicolon), // del !!*0, !!**1;
+  [PhMapGet]     = PHRASE(W(0), Assign, Get, W(1), Comma, E(2), Semicolon), // !!*0 = get !!*1, !!**2;
+  [PhMapHas]     = PHRASE(W(0), Assign, Has, W(1), Comma, E(2), Semicolon), // !!*0 = has !!*1, !!**2;
+  [PhSort]       = PHRASE(Sort, W(0), Comma, E(1), Semicolon), // sort !!*0, !!**1;
+  [PhAryNew]     = PHRASE(Int, W(0), Lbracket, E(2), Rbracket, Semicolon), // int !!*0[!!**2];
+  [PhAryInit]    = PHRASE(Int, W(0), Lbracket, E(2), Rbracket, Assign, Lbrace), // int !!*0[!!**2] = {
+  [PhExpr]       = PHRASE(E0(0), Semicolon), // !!***0;
+};
+
+#undef W
+#undef E
+#undef E0
+#undef PHRASE
+
 int wpc[N_WILDCARDS * 2]; // ワイルドカードにマッチしたトークンを指す
 int nextPc; // マッチしたフレーズの末尾の次のトークンを指す
 
@@ -341,30 +1013,23 @@ inline static int _end(int num)
   return N_WILDCARDS + num;
 }
 
-int match(int id, String phrase, int pc)
+int match(Phrase id, int pc)
 {
-  int head = id * (MAX_PHRASE_LEN + 1), phraseLen;
-
-  if (phraseTc[head + MAX_PHRASE_LEN] == 0) {
-    phraseLen = lexer(phrase, &phraseTc[head]);
-    assert(phraseLen <= MAX_PHRASE_LEN);
-    phraseTc[head + MAX_PHRASE_LEN] = phraseLen;
-  }
+  const int *phraseTc = phrases[id].tc, phraseLen = phrases[id].len;
 
-  phraseLen = phraseTc[head + MAX_PHRASE_LEN];
   for (int pos = 0; pos < phraseLen; ++pos) {
-    int phraTc = phraseTc[head + pos];
+    int phraTc = phraseTc[pos];
     if (phraTc == Wildcard || phraTc == Expr || phraTc == Expr0) {
       ++pos;
-      int num = phraseTc[head + pos] - Zero;
+      int num = phraseTc[pos] - Zero;
       wpc[num] = pc; // トークンの位置（式の場合は式の開始位置）
       if (phraTc == Wildcard) {
-        ++pc;
+        wpc[_end(num)] = ++pc; // 式として読むこともあるので、終了位置も入れておく
         continue;
       }
       int depth = 0; // 括弧の深さ
       for (;;) {
-        if (tc[pc] == Semicolon)
+        if (tc[pc] == Semicolon || tc[pc] == Period) // Periodはトークン列の終端の印
           break;
         if (tc[pc] == Comma && depth == 0)
           break;
@@ -396,6 +1061,11 @@ typedef intptr_t *IntPtr;
 
 IntPtr internalCode[10000]; // ソースコードをコンパイルして生成した内部コードを格納する
 IntPtr *icp;
+IntPtr *codeEnd; // 内部コードの終わり（遅延コンパイルしたコードはここから後ろに足していく）
+
+// 位置の表：命令ごとに、その命令を生成した文の先頭のトークンの位置を持つ（行はtcLineで引く）
+int icTok[sizeof internalCode / sizeof internalCode[0] / 5];
+int curTok; // コンパイル中の文の先頭のトークンの位置
 
 typedef enum {
   OpEnd,
@@ -432,10 +1102,64 @@ typedef enum {
   OpAryGet,
   OpArySet,
   OpPrm,
+  OpNop,
+  OpDivC,
+  OpModC,
+  OpSnapshot,
+  OpAryMap,
+  OpAryLen,
+  OpInput,
+  OpInputAry,
+  OpAryDyn,
+  OpPush,
+  OpPop,
+  OpDynLen,
+  OpReserve,
+  OpMapNew,
+  OpMapPut,
+  OpMapDel,
+  OpMapGet,
+  OpMapHas,
+  OpSort,
+  OpTimerStart,
+  OpTimerStop,
+  OpTimerReport,
+  OpLazy,
+  OpVecMap,
+  OpVecSum,
+  OpCeqI, // 以下、右の被演算子を命令に直接持つもの
+  OpCneI,
+  OpCltI,
+  OpCgeI,
+  OpCleI,
+  OpCgtI,
+  OpAddI,
+  OpSubI,
+  OpMulI,
+  OpBandI,
+  OpShrI,
+  OpJeqI,
+  OpJneI,
+  OpJltI,
+  OpJgeI,
+  OpJleI,
+  OpJgtI,
+  OpLopI,
+  OpAryGetI,
+  OpArySetI,
+  OpAryShare,
 } Opcode;
 
+
 void putIc(Opcode op, IntPtr p1, IntPtr p2, IntPtr p3, IntPtr p4)
 {
+  if (icp >= internalCode + sizeof internalCode / sizeof internalCode[0]) {
+    if (!hasCompileError)
+      printError("Too many instructions\n");
+    hasCompileError = 1;
+    return;
+  }
+  icTok[(icp - internalCode) / 5] = curTok;
   icp[0] = (IntPtr) op;
   icp[1] = p1;
   icp[2] = p2;
@@ -444,6 +1168,30 @@ void putIc(Opcode op, IntPtr p1, IntPtr p2, IntPtr p3, IntPtr p4)
   icp += 5;
 }
 
+char isDynArray[MAX_TOKEN_CODE + 1]; // 最後にint a[];で宣言された変数（REPLの前の行の宣言も覚えておく）
+
+// push, pop, len, reserveは可変長配列にだけ使える（ほかの配列には容量と長さがない）
+int dynArray(int slot)
+{
+  if (!isDynArray[slot] && !hasCompileError) {
+    printError("Not a dynamic array: %s\n", tokenStrs[slot]);
+    hasCompileError = 1;
+  }
+  return slot;
+}
+
+char isConstArray[MAX_TOKEN_CODE + 1]; // 最後にconst int a[n] = mmap(...);で宣言された変数
+
+// 読み出し専用の配列には書き込めない
+int writableArray(int slot)
+{
+  if (isConstArray[slot] && !hasCompileError) {
+    printError("Read-only array: %s\n", tokenStrs[slot]);
+    hasCompileError = 1;
+  }
+  return slot;
+}
+
 #define N_TMPS 10
 char tmpFlags[N_TMPS];
 
@@ -455,7 +1203,7 @@ int tmpAlloc()
       return Tmp0 + i;
     }
   }
-  printf("Register allocation failed\n");
+  printError("Register allocation failed\n");
   return -1;
 }
 
@@ -494,15 +1242,15 @@ int evalExpression(Precedence precedence)
   int res = -1, e0 = 0, e1 = 0, e2 = 0;
   nextPc = 0;
 
-  if (match(99, "( !!**0 )", epc)) { // 括弧
+  if (match(PhParen, epc)) { // 括弧
     res = expression(0);
   }
-  else if (match(72, "!!*0!!*1[!!**2]", epc) && tc[wpc[0]] == PlusPlus) { // 前置インクリメント
+  else if (match(PhPrefix, epc) && tc[wpc[0]] == PlusPlus) { // 前置インクリメント
     e2 = expression(2);
     res = tmpAlloc();
     putIc(OpAryGet, &vars[tc[wpc[1]]], &vars[e2], &vars[res], 0);
     putIc(OpAdd1, &vars[res], 0, 0, 0);
-    putIc(OpArySet, &vars[tc[wpc[1]]], &vars[e2], &vars[res], 0);
+    putIc(OpArySet, &vars[writableArray(tc[wpc[1]])], &vars[e2], &vars[res], 0);
   }
   else if (tc[epc] == PlusPlus) { // 前置インクリメント
     ++epc;
@@ -521,6 +1269,13 @@ int evalExpression(Precedence precedence)
     res = tmpAlloc();
     putIc(OpNot, &vars[res], &vars[e0], 0, 0);
   }
+  else if ((tc[epc] == Len || tc[epc] == Pop) && epc + 1 < epcEnd && // 可変長配列の長さ、末尾の要素の取り出し
+           (isDynArray[tc[epc + 1]] || tc[epc + 1] >= EndOfKeys && isAlphabet(tokenStrs[tc[epc + 1]][0]))) {
+    // 後ろに変数名が続かなければ、len、popという名前のただの変数として読む
+    res = tmpAlloc();
+    putIc(tc[epc] == Len ? OpDynLen : OpPop, &vars[res], &vars[dynArray(tc[epc + 1])], 0, 0);
+    epc += 2;
+  }
   else { // 変数もしくは定数
     res = tc[epc];
     ++epc;
@@ -545,7 +1300,7 @@ int evalExpression(Precedence precedence)
       putIc(OpCpy, &vars[res], &vars[e0], 0, 0);
       putIc(OpAdd1, &vars[e0], 0, 0, 0);
     }
-    else if (match(73, "[!!**0]!!*1", epc) && tc[wpc[1]] == PlusPlus) { // 後置インクリメント
+    else if (match(PhPostfix, epc) && tc[wpc[1]] == PlusPlus) { // 後置インクリメント
       e1 = res;
       res = tmpAlloc();
       e0 = expression(0);
@@ -553,16 +1308,16 @@ int evalExpression(Precedence precedence)
       putIc(OpAryGet, &vars[e1], &vars[e0], &vars[res], 0);
       e2 = tmpAlloc();
       putIc(OpAdd, &vars[e2], &vars[res], &vars[One], 0);
-      putIc(OpArySet, &vars[e1], &vars[e0], &vars[e2], 0);
+      putIc(OpArySet, &vars[writableArray(e1)], &vars[e0], &vars[e2], 0);
     }
-    else if (match(70, "[!!**0]=", epc)) {
+    else if (match(PhArySet, epc)) {
       e1 = res;
       e0 = expression(0);
       epc = nextPc;
       res = evalExpression(Infix_Assign);
-      putIc(OpArySet, &vars[e1], &vars[e0], &vars[res], 0);
+      putIc(OpArySet, &vars[writableArray(e1)], &vars[e0], &vars[res], 0);
     }
-    else if (match(71, "[!!**0]", epc)) {
+    else if (match(PhAryGet, epc)) {
       e1 = res;
       res = tmpAlloc();
       e0 = expression(0);
@@ -753,224 +1508,2899 @@ int exprsPutIc(int times, Opcode op, int tmpReg, int *err)
   return tmpReg;
 }
 
-int compile(String src)
+/*
+  最適化
+
+  compile()が生成した内部コード（goto先を設定する前のもの）を、基本ブロックに
+  分割して次のパスで書き換える。
+
+    1. 条件付き定数伝播（到達しない基本ブロックや、結果が決まっている分岐を消す）
+    2. コピー伝播と局所的な値番号付け（同じ計算をやり直さない）
+    3. 一時変数への不要な代入の削除と、一時変数を経由するコピーの合体
+
+  消した命令はいったんOpNopにしておき、最後に詰めてラベルの値を付け替える。
+*/
+int optLevel = 1; // 0: 最適化しない
+
+enum { OprNone, OprUse, OprDef, OprUseDef, OprLabel, OprRaw };
+
+const char operandKinds[][4] = {
+  [OpEnd]     = {OprNone},
+  [OpCpy]     = {OprDef, OprUse},
+  [OpCeq]     = {OprDef, OprUse, OprUse},
+  [OpCne]     = {OprDef, OprUse, OprUse},
+  [OpClt]     = {OprDef, OprUse, OprUse},
+  [OpCge]     = {OprDef, OprUse, OprUse},
+  [OpCle]     = {OprDef, OprUse, OprUse},
+  [OpCgt]     = {OprDef, OprUse, OprUse},
+  [OpAdd]     = {OprDef, OprUse, OprUse},
+  [OpSub]     = {OprDef, OprUse, OprUse},
+  [OpMul]     = {OprDef, OprUse, OprUse},
+  [OpDiv]     = {OprDef, OprUse, OprUse},
+  [OpMod]     = {OprDef, OprUse, OprUse},
+  [OpBand]    = {OprDef, OprUse, OprUse},
+  [OpShr]     = {OprDef, OprUse, OprUse},
+  [OpAdd1]    = {OprUseDef},
+  [OpNot]     = {OprDef, OprUse},
+  [OpNeg]     = {OprDef, OprUse},
+  [OpGoto]    = {OprLabel, OprLabel},
+  [OpJeq]     = {OprLabel, OprUse, OprUse},
+  [OpJne]     = {OprLabel, OprUse, OprUse},
+  [OpJlt]     = {OprLabel, OprUse, OprUse},
+  [OpJge]     = {OprLabel, OprUse, OprUse},
+  [OpJle]     = {OprLabel, OprUse, OprUse},
+  [OpJgt]     = {OprLabel, OprUse, OprUse},
+  [OpLop]     = {OprLabel, OprUseDef, OprUse},
+  [OpPrint]   = {OprUse},
+  [OpTime]    = {OprNone},
+  [OpPrints]  = {OprUse},
+  [OpAryNew]  = {OprDef, OprUse},
+  [OpAryInit] = {OprUse, OprRaw, OprRaw},
+  [OpAryGet]  = {OprUse, OprUse, OprDef},
+  [OpArySet]  = {OprUse, OprUse, OprUse},
+  [OpPrm]     = {OprUse, OprUse, OprUse, OprUse},
+  [OpNop]     = {OprNone},
+  [OpDivC]    = {OprDef, OprUse, OprRaw, OprRaw},
+  [OpModC]    = {OprDef, OprUse, OprRaw, OprRaw},
+  [OpSnapshot] = {OprUse, OprRaw, OprRaw},
+  [OpAryMap]  = {OprDef, OprUse},
+  [OpAryLen]  = {OprDef, OprUse},
+  [OpInput]   = {OprDef},
+  [OpInputAry] = {OprDef, OprUse, OprUse},
+  [OpAryDyn]  = {OprDef},
+  [OpPush]    = {OprUseDef, OprUse},
+  [OpPop]     = {OprDef, OprUse},
+  [OpDynLen]  = {OprDef, OprUse},
+  [OpReserve] = {OprUseDef, OprUse},
+  [OpMapNew]  = {OprDef},
+  [OpMapPut]  = {OprUse, OprUse, OprUse},
+  [OpMapDel]  = {OprUse, OprUse},
+  [OpMapGet]  = {OprDef, OprUse, OprUse},
+  [OpMapHas]  = {OprDef, OprUse, OprUse},
+  [OpSort]    = {OprUse, OprUse},
+  [OpTimerStart] = {OprRaw},
+  [OpTimerStop] = {OprRaw},
+  [OpTimerReport] = {OprNone},
+  [OpLazy]    = {OprRaw, OprRaw},
+  [OpVecMap]  = {OprUseDef, OprUse, OprUse, OprRaw}, // 続くOpPrmに配列と値を持つ
+  [OpVecSum]  = {OprUseDef, OprUse, OprUseDef, OprRaw},
+  [OpCeqI]    = {OprDef, OprUse, OprRaw},
+  [OpCneI]    = {OprDef, OprUse, OprRaw},
+  [OpCltI]    = {OprDef, OprUse, OprRaw},
+  [OpCgeI]    = {OprDef, OprUse, OprRaw},
+  [OpCleI]    = {OprDef, OprUse, OprRaw},
+  [OpCgtI]    = {OprDef, OprUse, OprRaw},
+  [OpAddI]    = {OprDef, OprUse, OprRaw},
+  [OpSubI]    = {OprDef, OprUse, OprRaw},
+  [OpMulI]    = {OprDef, OprUse, OprRaw},
+  [OpBandI]   = {OprDef, OprUse, OprRaw},
+  [OpShrI]    = {OprDef, OprUse, OprRaw},
+  [OpJeqI]    = {OprLabel, OprUse, OprRaw},
+  [OpJneI]    = {OprLabel, OprUse, OprRaw},
+  [OpJltI]    = {OprLabel, OprUse, OprRaw},
+  [OpJgeI]    = {OprLabel, OprUse, OprRaw},
+  [OpJleI]    = {OprLabel, OprUse, OprRaw},
+  [OpJgtI]    = {OprLabel, OprUse, OprRaw},
+  [OpLopI]    = {OprLabel, OprUseDef, OprRaw},
+  [OpAryGetI] = {OprUse, OprRaw, OprDef},
+  [OpArySetI] = {OprUse, OprRaw, OprUse},
+  [OpAryShare] = {OprDef, OprRaw, OprRaw},
+};
+
+inline static int operandKind(IntPtr *ic, int i) // i = 1...4
 {
-  int nTokens = lexer(src, tc);
-  tc[nTokens++] = Semicolon; // 末尾に「;」を付け忘れることが多いので、付けてあげる
-  tc[nTokens] = tc[nTokens + 1] = tc[nTokens + 2] = tc[nTokens + 3] = Period; // エラー表示用
+  return operandKinds[(Opcode) ic[0]][i - 1];
+}
 
-  icp = internalCode;
+inline static int slotOf(IntPtr p)
+{
+  return p - vars;
+}
 
-  for (int i = 0; i < N_TMPS; ++i)
-    tmpFlags[i] = 0;
-  tmpLabelNo = 0;
-  int *curBlock = initBlockInfo(), *loopBlock = NULL;
+inline static int isJump(Opcode op)
+{
+  return OpGoto <= op && op <= OpLop || OpJeqI <= op && op <= OpLopI;
+}
 
-  int pc;
-  for (pc = 0; pc < nTokens;) {
-    int e0 = 0, e2 = 0;
-    if (match(0, "!!*0 = !!*1;", pc)) {
-      putIc(OpCpy, &vars[tc[wpc[0]]], &vars[tc[wpc[1]]], 0, 0);
-    }
-    else if (match(10, "!!*0 = !!*1 + 1; if (!!*2 < !!*3) goto !!*4;", pc) && tc[wpc[0]] == tc[wpc[1]] && tc[wpc[0]] == tc[wpc[2]]) {
-      putIc(OpLop, &vars[tc[wpc[4]]], &vars[tc[wpc[0]]], &vars[tc[wpc[3]]], 0);
-    }
-    else if (match(9, "!!*0 = !!*1 + 1;", pc) && tc[wpc[0]] == tc[wpc[1]]) { // +1専用の命令
-      putIc(OpAdd1, &vars[tc[wpc[0]]], 0, 0, 0);
-    }
-    else if (match(1, "!!*0 = !!*1 !!*2 !!*3;", pc) && Equal <= tc[wpc[2]] && tc[wpc[2]] < Assign) { // 加算、減算など
-      putIc(OpCeq + tc[wpc[2]] - Equal, &vars[tc[wpc[0]]], &vars[tc[wpc[1]]], &vars[tc[wpc[3]]], 0);
+inline static int isTerminator(Opcode op)
+{
+  return isJump(op) || op == OpEnd;
+}
+
+// 副作用がなく、結果を使わなければ消してよい命令
+inline static int isPure(Opcode op)
+{
+  return OpCpy <= op && op <= OpShr || op == OpNot || op == OpNeg || op == OpAryGet || op == OpDivC || op == OpModC ||
+         OpCeqI <= op && op <= OpShrI || op == OpAryGetI;
+}
+
+// 配列の中身を書き換える命令
+inline static int writesMemory(Opcode op)
+{
+  return op == OpArySet || op == OpAryInit || op == OpInputAry || op == OpPush || op == OpPop || op == OpReserve || op == OpSort || op == OpVecMap ||
+         op == OpArySetI;
+}
+
+// 書き込み先の被演算子の番号（なければ0）
+int defOperand(IntPtr *ic)
+{
+  for (int i = 1; i <= 4; ++i) {
+    int kind = operandKind(ic, i);
+    if (kind == OprDef || kind == OprUseDef)
+      return i;
+  }
+  return 0;
+}
+
+#define MAX_IC (sizeof internalCode / sizeof internalCode[0] / 5)
+
+typedef struct { int begin, end, succ[2]; } BasicBlock;
+
+BasicBlock *blocks;
+int nBlocks, nIc, *blockOf;
+
+inline static IntPtr *icAt(int k)
+{
+  return &internalCode[k * 5];
+}
+
+inline static int jumpTarget(IntPtr *ic)
+{
+  return *ic[1] / 5;
+}
+
+inline static int isScratch(int slot) // 文をまたいで値を持ち越さない変数
+{
+  return Tmp0 <= slot && slot <= Tmp9;
+}
+
+char isDefined[MAX_TOKEN_CODE + 1]; // 内部コードのどこかで書き込まれる変数
+
+void markDefined()
+{
+  memset(isDefined, 0, sizeof isDefined);
+  for (int k = 0; k < nIc; ++k) {
+    IntPtr *ic = icAt(k);
+    int d = defOperand(ic);
+    if (d)
+      isDefined[slotOf(ic[d])] = 1;
+  }
+}
+
+inline static int isConstSlot(int slot)
+{
+  String s = tokenStrs[slot];
+  return !isDefined[slot] && (isNumber(s[0]) || s[0] == '-' && isNumber(s[1]));
+}
+
+// 値vを持つ定数のトークンコードを返す（トークンが足りなければ-1）
+int constSlot(intptr_t v)
+{
+  char str[24];
+  sprintf(str, "%ld", (long) v);
+  int len = strlen(str);
+  for (int i = 0; i < nTokenCodes; ++i) {
+    if (len == tokenLens[i] && strncmp(str, tokenStrs[i], len) == 0)
+      return vars[i] == v ? i : -1;
+  }
+  if (nTokenCodes >= MAX_TOKEN_CODE)
+    return -1;
+  return getTokenCode(str, len);
+}
+
+int foldOp(Opcode op, intptr_t a, intptr_t b, intptr_t *res)
+{
+  uintptr_t ua = a, ub = b;
+  switch (op) {
+  case OpCpy:  *res = a;                   return 1;
+  case OpCeq:  *res = a == b;              return 1;
+  case OpCne:  *res = a != b;              return 1;
+  case OpClt:  *res = a <  b;              return 1;
+  case OpCge:  *res = a >= b;              return 1;
+  case OpCle:  *res = a <= b;              return 1;
+  case OpCgt:  *res = a >  b;              return 1;
+  case OpAdd:  *res = (intptr_t) (ua + ub); return 1;
+  case OpSub:  *res = (intptr_t) (ua - ub); return 1;
+  case OpMul:  *res = (intptr_t) (ua * ub); return 1;
+  case OpBand: *res = a & b;               return 1;
+  case OpAdd1: *res = (intptr_t) (ua + 1); return 1;
+  case OpNot:  *res = !a;                  return 1;
+  case OpNeg:  *res = (intptr_t) (0 - ua); return 1;
+  case OpDiv:
+  case OpMod:
+    if (b == 0 || (a == INTPTR_MIN && b == -1)) // 実行時のエラーをそのまま残す
+      return 0;
+    *res = op == OpDiv ? a / b : a % b;
+    return 1;
+  case OpShr:
+    if (b < 0 || b >= (intptr_t) (sizeof(intptr_t) * 8))
+      return 0;
+    *res = a >> b;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// 基本ブロックに分割する（分割できないコードなら0を返す）
+int buildBlocks()
+{
+  static char isLeader[MAX_IC + 1];
+  static int blockOfBuf[MAX_IC + 1];
+  static BasicBlock blockBuf[MAX_IC + 1];
+
+  blocks = blockBuf;
+  blockOf = blockOfBuf;
+  memset(isLeader, 0, nIc + 1);
+  isLeader[0] = 1;
+  for (int k = 0; k < nIc; ++k) {
+    IntPtr *ic = icAt(k);
+    Opcode op = (Opcode) ic[0];
+    if (op == OpPrm)
+      return 0;
+    if (isJump(op)) {
+      if (*ic[1] < 0 || *ic[1] >= nIc * 5 || *ic[1] % 5 != 0)
+        return 0;
+      isLeader[jumpTarget(ic)] = 1;
+    }
+    if (isTerminator(op))
+      isLeader[k + 1] = 1;
+  }
+
+  nBlocks = 0;
+  for (int k = 0; k < nIc; ++k) {
+    if (isLeader[k]) {
+      if (nBlocks > 0)
+        blocks[nBlocks - 1].end = k;
+      blocks[nBlocks].begin = k;
+      ++nBlocks;
+    }
+    blockOf[k] = nBlocks - 1;
+  }
+  blocks[nBlocks - 1].end = nIc;
+
+  for (int b = 0; b < nBlocks; ++b) {
+    IntPtr *last = icAt(blocks[b].end - 1);
+    Opcode op = (Opcode) last[0];
+    int next = b + 1 < nBlocks ? b + 1 : -1;
+    blocks[b].succ[0] = blocks[b].succ[1] = -1;
+    if (op == OpEnd)
+      ;
+    else if (op == OpGoto)
+      blocks[b].succ[0] = blockOf[jumpTarget(last)];
+    else if (isJump(op)) {
+      blocks[b].succ[0] = blockOf[jumpTarget(last)];
+      blocks[b].succ[1] = next;
+    }
+    else
+      blocks[b].succ[0] = next;
+  }
+  return 1;
+}
+
+inline static void makeNop(IntPtr *ic)
+{
+  ic[0] = (IntPtr) OpNop;
+}
+
+inline static void makeGoto(IntPtr *ic)
+{
+  ic[0] = (IntPtr) OpGoto;
+  ic[2] = ic[1];
+  ic[3] = ic[4] = 0;
+}
+
+inline static void makeCpy(IntPtr *ic, int def, int src)
+{
+  IntPtr dst = ic[defOperand(ic)];
+  ic[0] = (IntPtr) OpCpy;
+  ic[1] = dst;
+  ic[2] = &vars[src];
+  ic[3] = ic[4] = 0;
+  assert(slotOf(dst) == def);
+}
+
+/*
+  条件付き定数伝播
+
+  格子は 未定(LatUndef) > 定数(LatConst) > 不定(LatVarying) の3段。
+  プログラムの入口ではすべての変数が不定（REPLやホストが前もって値を入れている
+  ことがある）で、一度も書き込まれない数値リテラルだけが定数になる。
+  到達可能な辺だけをたどるので、成立しない分岐の先は到達しないまま残る。
+*/
+enum { LatUndef, LatConst, LatVarying };
+
+typedef struct {
+  int *trackIdx;    // 変数 -> 追跡番号（追跡しなければ-1）
+  int nTracked;
+  char *kinds;      // [nBlocks * nTracked] 各ブロック入口の状態
+  intptr_t *vals;
+  char *reachable;
+} ConstProp;
+
+inline static int latOf(ConstProp *cp, char *kind, intptr_t *val, int slot, intptr_t *v)
+{
+  int t = cp->trackIdx[slot];
+  if (t < 0) {
+    if (!isConstSlot(slot))
+      return LatVarying;
+    *v = vars[slot];
+    return LatConst;
+  }
+  *v = val[t];
+  return kind[t];
+}
+
+inline static void setLat(ConstProp *cp, char *kind, intptr_t *val, int slot, int k, intptr_t v)
+{
+  int t = cp->trackIdx[slot];
+  kind[t] = k;
+  val[t] = v;
+}
+
+// 1命令ぶん状態を進める。rewriteが真なら分かった定数で命令を書き換える。
+// 分岐命令のときは、分岐する(1)/しない(0)/分からない(-1)を返す。
+int constPropIc(ConstProp *cp, IntPtr *ic, char *kind, intptr_t *val, int rewrite)
+{
+  Opcode op = (Opcode) ic[0];
+  intptr_t v[4] = {0}, res = 0;
+  int lat = LatConst, nUses = 0, branch = -1;
+
+  for (int i = 1; i <= 4; ++i) {
+    int k = operandKind(ic, i);
+    if (k != OprUse && k != OprUseDef)
+      continue;
+    int l = latOf(cp, kind, val, slotOf(ic[i]), &v[nUses]);
+    if (rewrite && k == OprUse && l == LatConst && cp->trackIdx[slotOf(ic[i])] >= 0) {
+      int c = constSlot(v[nUses]);
+      if (c >= 0)
+        ic[i] = &vars[c];
+    }
+    ++nUses;
+    if (l == LatVarying || lat == LatVarying)
+      lat = LatVarying;
+    else if (l == LatUndef)
+      lat = LatUndef;
+  }
+
+  if (OpJeq <= op && op <= OpJgt) {
+    if (lat == LatConst && foldOp(OpCeq + op - OpJeq, v[0], v[1], &res))
+      branch = res != 0;
+    if (rewrite && branch == 1)
+      makeGoto(ic);
+    else if (rewrite && branch == 0)
+      makeNop(ic);
+    return branch;
+  }
+  if (op == OpGoto)
+    return 1;
+
+  int d = defOperand(ic);
+  if (d == 0)
+    return -1;
+  int def = slotOf(ic[d]);
+  if (op == OpLop) {
+    if (lat == LatConst) {
+      res = (intptr_t) ((uintptr_t) v[0] + 1);
+      branch = res < v[1];
+    }
+    setLat(cp, kind, val, def, lat, res);
+    return branch;
+  }
+  if (op == OpAryGet || op == OpAryNew || op == OpAryShare || lat == LatConst && !foldOp(op, v[0], v[1], &res))
+    lat = LatVarying;
+  setLat(cp, kind, val, def, lat, res);
+  if (rewrite && lat == LatConst && !(op == OpCpy && cp->trackIdx[slotOf(ic[2])] < 0)) {
+    int c = constSlot(res);
+    if (c >= 0)
+      makeCpy(ic, def, c);
+  }
+  return -1;
+}
+
+void constProp()
+{
+  ConstProp cp;
+  static int trackIdx[MAX_TOKEN_CODE + 1];
+
+  cp.nTracked = 0;
+  for (int i = 0; i <= MAX_TOKEN_CODE; ++i)
+    trackIdx[i] = isDefined[i] ? cp.nTracked++ : -1;
+  cp.trackIdx = trackIdx;
+
+  int n = cp.nTracked;
+  if ((long) nBlocks * n > 4000000) // 大きすぎるプログラムは諦める
+    return;
+  cp.kinds = calloc((size_t) (nBlocks + 1) * n + 1, 1);
+  cp.vals = calloc((size_t) (nBlocks + 1) * n + 1, sizeof(intptr_t));
+  cp.reachable = calloc(nBlocks, 1);
+  int *worklist = malloc(nBlocks * sizeof(int)), nWork = 0;
+  char *inWork = calloc(nBlocks, 1);
+  if (cp.kinds == NULL || cp.vals == NULL || cp.reachable == NULL || worklist == NULL || inWork == NULL)
+    goto exit;
+  char *kind = &cp.kinds[nBlocks * n]; // 作業用
+  intptr_t *val = &cp.vals[nBlocks * n];
+
+  memset(cp.kinds, LatVarying, n); // 入口
+  cp.reachable[0] = 1;
+  worklist[nWork++] = 0;
+  inWork[0] = 1;
+  while (nWork > 0) {
+    int b = worklist[--nWork];
+    inWork[b] = 0;
+    memcpy(kind, &cp.kinds[b * n], n);
+    memcpy(val, &cp.vals[b * n], n * sizeof(intptr_t));
+    int branch = -1;
+    for (int k = blocks[b].begin; k < blocks[b].end; ++k)
+      branch = constPropIc(&cp, icAt(k), kind, val, 0);
+
+    for (int e = 0; e < 2; ++e) {
+      int s = blocks[b].succ[e];
+      if (s < 0 || blocks[b].succ[1] >= 0 && branch >= 0 && branch != (e == 0))
+        continue;
+      int isChanged = !cp.reachable[s];
+      char *sk = &cp.kinds[s * n];
+      intptr_t *sv = &cp.vals[s * n];
+      for (int t = 0; t < n; ++t) {
+        int k = kind[t];
+        if (!cp.reachable[s] || sk[t] == LatUndef)
+          ;
+        else if (k == LatUndef || sk[t] == LatVarying || k == LatConst && sv[t] == val[t])
+          continue;
+        else
+          k = LatVarying;
+        if (sk[t] != k || sv[t] != val[t]) {
+          sk[t] = k;
+          sv[t] = val[t];
+          isChanged = 1;
+        }
+      }
+      cp.reachable[s] = 1;
+      if (isChanged && !inWork[s]) {
+        worklist[nWork++] = s;
+        inWork[s] = 1;
+      }
+    }
+  }
+
+  for (int b = 0; b < nBlocks; ++b) {
+    if (!cp.reachable[b]) {
+      for (int k = blocks[b].begin; k < blocks[b].end; ++k)
+        makeNop(icAt(k));
+      continue;
+    }
+    memcpy(kind, &cp.kinds[b * n], n);
+    memcpy(val, &cp.vals[b * n], n * sizeof(intptr_t));
+    for (int k = blocks[b].begin; k < blocks[b].end; ++k)
+      constPropIc(&cp, icAt(k), kind, val, 1);
+  }
+exit:
+  free(cp.kinds);
+  free(cp.vals);
+  free(cp.reachable);
+  free(worklist);
+  free(inWork);
+}
+
+/*
+  コピー伝播と局所的な値番号付け
+
+  基本ブロックの中で「y = x」の後のyの読み出しをxに置き換え、同じ演算を同じ
+  被演算子でもう一度計算しているところは、前の結果のコピーに置き換える。
+*/
+#define MAX_AVAIL 64
+
+typedef struct { Opcode op; int a, b, holder; } AvailExpr;
+
+inline static int isCommutative(Opcode op)
+{
+  return op == OpAdd || op == OpMul || op == OpBand || op == OpCeq || op == OpCne;
+}
+
+void localValueNumbering()
+{
+  int copyDst[MAX_AVAIL], copySrc[MAX_AVAIL], nCopies;
+  AvailExpr avail[MAX_AVAIL];
+  int nAvail;
+
+  for (int b = 0; b < nBlocks; ++b) {
+    nCopies = nAvail = 0;
+    for (int k = blocks[b].begin; k < blocks[b].end; ++k) {
+      IntPtr *ic = icAt(k);
+      Opcode op = (Opcode) ic[0];
+      int i, j;
+
+      for (i = 1; i <= 4; ++i) {
+        if (operandKind(ic, i) != OprUse)
+          continue;
+        for (j = 0; j < nCopies; ++j) {
+          if (copyDst[j] == slotOf(ic[i])) {
+            ic[i] = &vars[copySrc[j]];
+            break;
+          }
+        }
+      }
+
+      int d = defOperand(ic), def = d ? slotOf(ic[d]) : -1, a = 0, c = 0;
+      if (op == OpDivC || op == OpModC)
+        ;
+      else if (isPure(op) && op != OpCpy) {
+        a = slotOf(ic[op == OpAryGet ? 1 : 2]);
+        c = op == OpNot || op == OpNeg ? -1 : slotOf(ic[op == OpAryGet ? 2 : 3]);
+        if (isCommutative(op) && a > c) {
+          int tmp = a; a = c; c = tmp;
+        }
+        for (j = 0; j < nAvail && !(avail[j].op == op && avail[j].a == a && avail[j].b == c); ++j)
+          ;
+        if (j < nAvail && avail[j].holder == def) { // すでに同じ値が入っている
+          makeNop(ic);
+          continue;
+        }
+        if (j < nAvail) {
+          makeCpy(ic, def, avail[j].holder);
+          op = OpCpy;
+        }
+      }
+
+      if (def >= 0 || writesMemory(op)) { // 書き込みで無効になるものを捨てる
+        for (i = j = 0; i < nCopies; ++i) {
+          if (copyDst[i] == def || copySrc[i] == def)
+            continue;
+          copyDst[j] = copyDst[i]; copySrc[j] = copySrc[i]; ++j;
+        }
+        nCopies = j;
+        for (i = j = 0; i < nAvail; ++i) {
+          AvailExpr *e = &avail[i];
+          if (e->a == def || e->b == def || e->holder == def)
+            continue;
+          if (e->op == OpAryGet && writesMemory(op))
+            continue;
+          avail[j++] = *e;
+        }
+        nAvail = j;
+      }
+
+      if (op == OpCpy && def != slotOf(ic[2]) && nCopies < MAX_AVAIL) {
+        copyDst[nCopies] = def;
+        copySrc[nCopies] = slotOf(ic[2]);
+        ++nCopies;
+      }
+      else if (isPure(op) && op != OpCpy && op != OpDivC && op != OpModC && def != a && def != c && nAvail < MAX_AVAIL)
+        avail[nAvail++] = (AvailExpr) {op, a, c, def};
+    }
+  }
+}
+
+/*
+  不要な代入の削除
+
+  一時変数（_t0..._t9）の生存区間を基本ブロックをまたいで解析して、その後で
+  読まれない一時変数への代入を消す。あわせて「_t = 式; x = _t;」を「x = 式;」
+  にまとめる。
+*/
+typedef unsigned short ScratchSet;
+
+inline static ScratchSet scratchBit(int slot)
+{
+  return isScratch(slot) ? (ScratchSet) 1 << (slot - Tmp0) : 0;
+}
+
+ScratchSet icUses(IntPtr *ic)
+{
+  ScratchSet s = 0;
+  for (int i = 1; i <= 4; ++i) {
+    int k = operandKind(ic, i);
+    if (k == OprUse || k == OprUseDef)
+      s |= scratchBit(slotOf(ic[i]));
+  }
+  return s;
+}
+
+int usesSlot(IntPtr *ic, int slot)
+{
+  for (int i = 1; i <= 4; ++i) {
+    int k = operandKind(ic, i);
+    if ((k == OprUse || k == OprUseDef) && slotOf(ic[i]) == slot)
+      return 1;
+  }
+  return 0;
+}
+
+int deadStoreElimination()
+{
+  static ScratchSet liveIn[MAX_IC + 1], liveAfter[MAX_IC + 1];
+  int changed = 0;
+
+  for (int b = 0; b < nBlocks; ++b)
+    liveIn[b] = 0;
+  for (int isChanged = 1; isChanged;) {
+    isChanged = 0;
+    for (int b = nBlocks - 1; b >= 0; --b) {
+      ScratchSet live = 0;
+      for (int e = 0; e < 2; ++e) {
+        if (blocks[b].succ[e] >= 0)
+          live |= liveIn[blocks[b].succ[e]];
+      }
+      for (int k = blocks[b].end - 1; k >= blocks[b].begin; --k) {
+        IntPtr *ic = icAt(k);
+        liveAfter[k] = live;
+        int d = defOperand(ic);
+        if (d && operandKind(ic, d) == OprDef)
+          live &= ~scratchBit(slotOf(ic[d]));
+        live |= icUses(ic);
+      }
+      if (live != liveIn[b]) {
+        liveIn[b] = live;
+        isChanged = 1;
+      }
+    }
+  }
+
+  for (int k = nIc - 1; k >= 0; --k) {
+    IntPtr *ic = icAt(k);
+    Opcode op = (Opcode) ic[0];
+    if ((op == OpJeq || op == OpJne) && slotOf(ic[3]) == Zero && isConstSlot(Zero) && k > blocks[blockOf[k]].begin) {
+      // _t = a < b; if (_t != 0) goto L; を if (a < b) goto L; にまとめる
+      IntPtr *prev = icAt(k - 1);
+      Opcode cmp = (Opcode) prev[0];
+      int t = slotOf(ic[2]);
+      if (OpCeq <= cmp && cmp <= OpCgt && slotOf(prev[1]) == t && isScratch(t) && !(liveAfter[k] & scratchBit(t))) {
+        ic[0] = (IntPtr) (Opcode) (OpJeq + ((cmp - OpCeq) ^ (op == OpJeq)));
+        ic[2] = prev[2];
+        ic[3] = prev[3];
+        makeNop(prev);
+        changed = 1;
+      }
+      continue;
+    }
+    if (!isPure(op))
+      continue;
+    int def = slotOf(ic[defOperand(ic)]);
+    if (op == OpCpy && def == slotOf(ic[2]) || isScratch(def) && !(liveAfter[k] & scratchBit(def))) {
+      makeNop(ic);
+      changed = 1;
+      continue;
+    }
+    if (op != OpCpy || !isScratch(slotOf(ic[2])) || (liveAfter[k] & scratchBit(slotOf(ic[2]))))
+      continue;
+
+    // x = _t; の_tを書いた命令を同じ基本ブロックの中で探す
+    int t = slotOf(ic[2]), j;
+    for (j = k - 1; j >= blocks[blockOf[k]].begin; --j) {
+      IntPtr *prev = icAt(j);
+      int d = defOperand(prev);
+      if (d && slotOf(prev[d]) == t)
+        break;
+      if (usesSlot(prev, t) || usesSlot(prev, def) || d && slotOf(prev[d]) == def)
+        j = -1;
+    }
+    if (j < blocks[blockOf[k]].begin || !isPure((Opcode) icAt(j)[0]))
+      continue;
+    IntPtr *prev = icAt(j);
+    prev[defOperand(prev)] = &vars[def];
+    makeNop(ic);
+    for (; j < k; ++j)
+      liveAfter[j] |= scratchBit(def);
+    changed = 1;
+  }
+  return changed;
+}
+
+// 同じ基本ブロックの中で、読まれる前に上書きされる代入を消す
+void removeOverwrittenStores()
+{
+  for (int b = 0; b < nBlocks; ++b) {
+    for (int k = blocks[b].begin; k < blocks[b].end; ++k) {
+      IntPtr *ic = icAt(k);
+      if (!isPure((Opcode) ic[0]))
+        continue;
+      int def = slotOf(ic[defOperand(ic)]);
+      for (int j = k + 1; j < blocks[b].end; ++j) {
+        IntPtr *next = icAt(j);
+        if (usesSlot(next, def))
+          break;
+        int d = defOperand(next);
+        if (d && slotOf(next[d]) == def) {
+          makeNop(ic);
+          break;
+        }
+      }
+    }
+  }
+}
+
+// OpNopを取り除いて詰め、ラベルの値を付け替える
+void compactIc()
+{
+  static int newPos[MAX_IC + 1];
+  static char isRemapped[MAX_TOKEN_CODE + 1];
+  int k, n = 0;
+
+  for (k = 0; k < nIc; ++k) {
+    newPos[k] = n;
+    if ((Opcode) icAt(k)[0] != OpNop)
+      ++n;
+  }
+  newPos[nIc] = n;
+
+  memset(isRemapped, 0, sizeof isRemapped);
+  for (k = 0; k < nIc; ++k) {
+    IntPtr *ic = icAt(k);
+    if (!isJump((Opcode) ic[0]) || isRemapped[slotOf(ic[1])])
+      continue;
+    isRemapped[slotOf(ic[1])] = 1;
+    *ic[1] = newPos[jumpTarget(ic)] * 5;
+  }
+
+  for (k = 0; k < nIc; ++k) {
+    if ((Opcode) icAt(k)[0] != OpNop && newPos[k] != k) {
+      memcpy(icAt(newPos[k]), icAt(k), 5 * sizeof(IntPtr));
+      icTok[newPos[k]] = icTok[k];
+    }
+  }
+  nIc = n;
+}
+
+// 直後の命令へのgoto（分岐を消した跡に残る）を取り除く
+void removeJumpsToNext()
+{
+  for (int k = 0; k < nIc; ++k) {
+    IntPtr *ic = icAt(k);
+    Opcode op = (Opcode) ic[0];
+    if ((op == OpGoto || OpJeq <= op && op <= OpJgt) && jumpTarget(ic) == k + 1)
+      makeNop(ic);
+  }
+}
+
+/*
+  強度低減
+
+  定数による除算と剰余は、掛け算とシフトに置き換える（OpDivC, OpModC）。
+  被演算子には、除数から求めた魔法数と、シフト量と除数をまとめたものを直接持たせる。
+  See Hacker's Delight 10-4 "Signed Division by Divisors >= 2".
+*/
+#define INTPTR_BITS ((int) sizeof(intptr_t) * 8)
+#if INTPTR_MAX == INT32_MAX
+#define HAS_MUL_HIGH
+inline static intptr_t mulHigh(intptr_t a, intptr_t b)
+{
+  return (intptr_t) (((int64_t) a * b) >> 32);
+}
+#elif defined(__SIZEOF_INT128__)
+#define HAS_MUL_HIGH
+inline static intptr_t mulHigh(intptr_t a, intptr_t b)
+{
+  return (intptr_t) (((__int128) a * b) >> 64);
+}
+#endif
+
+#if defined(HAS_MUL_HIGH)
+void divMagic(intptr_t d, intptr_t *magic, int *shift) // d >= 2
+{
+  const uintptr_t two = (uintptr_t) 1 << (INTPTR_BITS - 1);
+  uintptr_t ad = d, anc = two - 1 - two % ad;
+  uintptr_t q1 = two / anc, r1 = two - q1 * anc, q2 = two / ad, r2 = two - q2 * ad, delta;
+  int p = INTPTR_BITS - 1;
+  do {
+    ++p;
+    q1 *= 2; r1 *= 2;
+    if (r1 >= anc) { ++q1; r1 -= anc; }
+    q2 *= 2; r2 *= 2;
+    if (r2 >= ad) { ++q2; r2 -= ad; }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  *magic = (intptr_t) (q2 + 1);
+  *shift = p - INTPTR_BITS;
+}
+
+// icp[3]: 魔法数, icp[4]: 除数 << 8 | シフト量
+inline static intptr_t divByMagic(intptr_t n, intptr_t magic, intptr_t packed)
+{
+  intptr_t q = mulHigh(magic, n) + ((magic >> (INTPTR_BITS - 1)) & n);
+  q >>= packed & 0xff;
+  return q + (intptr_t) ((uintptr_t) q >> (INTPTR_BITS - 1));
+}
+#endif
+
+void reduceDivision()
+{
+#if defined(HAS_MUL_HIGH)
+  for (int k = 0; k < nIc; ++k) {
+    IntPtr *ic = icAt(k);
+    Opcode op = (Opcode) ic[0];
+    int divisor = slotOf(ic[3]);
+    if (op != OpDiv && op != OpMod || !isConstSlot(divisor))
+      continue;
+    intptr_t d = vars[divisor], magic;
+    int shift;
+    if (d < 2 || d > INTPTR_MAX >> 8)
+      continue;
+    divMagic(d, &magic, &shift);
+    ic[0] = (IntPtr) (Opcode) (op == OpDiv ? OpDivC : OpModC);
+    ic[3] = (IntPtr) magic;
+    ic[4] = (IntPtr) (d << 8 | shift);
+  }
+#endif
+}
+
+/*
+  OpLopのループ（target...OpLop）の誘導変数iについて、ループ内の「x = i * w」
+  （wはループ不変）を、ループの手前で「k = i * w」、OpLopの直前で「k = k + w」と
+  更新する隠し変数kのコピーに置き換える。
+*/
+int ivNo;
+
+int ivAlloc()
+{
+  char str[10];
+  if (nTokenCodes >= MAX_TOKEN_CODE)
+    return -1;
+  sprintf(str, "_iv%d", ivNo);
+  ++ivNo;
+  return getTokenCode(str, strlen(str));
+}
+
+// posの位置にcount個の空き命令を挿入する。shiftAtPosが真ならposへのgotoも挿入した命令の後ろを指すようにする
+int insertIc(int pos, int count, int shiftAtPos)
+{
+  static char isRemapped[MAX_TOKEN_CODE + 1];
+
+  if (nIc + count > MAX_IC)
+    return 0;
+  memset(isRemapped, 0, sizeof isRemapped);
+  for (int k = 0; k < nIc; ++k) {
+    IntPtr *ic = icAt(k);
+    if (!isJump((Opcode) ic[0]) || isRemapped[slotOf(ic[1])])
+      continue;
+    isRemapped[slotOf(ic[1])] = 1;
+    int target = jumpTarget(ic);
+    if (target > pos || target == pos && shiftAtPos)
+      *ic[1] += count * 5;
+  }
+  memmove(icAt(pos + count), icAt(pos), (nIc - pos) * 5 * sizeof(IntPtr));
+  memmove(&icTok[pos + count], &icTok[pos], (nIc - pos) * sizeof(int));
+  for (int k = pos; k < pos + count; ++k)
+    makeNop(icAt(k));
+  nIc += count;
+  return 1;
+}
+
+// ループの外から[begin, end]の途中へ飛び込むgotoがなければ真
+int isSingleEntryLoop(int begin, int end)
+{
+  for (int k = 0; k < nIc; ++k) {
+    IntPtr *ic = icAt(k);
+    if (!isJump((Opcode) ic[0]) || begin <= k && k <= end)
+      continue;
+    int target = jumpTarget(ic);
+    if (begin <= target && target <= end)
+      return 0;
+  }
+  return 1;
+}
+
+int isDefinedIn(int slot, int begin, int end)
+{
+  for (int k = begin; k < end; ++k) {
+    IntPtr *ic = icAt(k);
+    int d = defOperand(ic);
+    if (d && slotOf(ic[d]) == slot)
+      return 1;
+  }
+  return 0;
+}
+
+inline static void setIc(IntPtr *ic, Opcode op, IntPtr p1, IntPtr p2, IntPtr p3)
+{
+  ic[0] = (IntPtr) op;
+  ic[1] = p1;
+  ic[2] = p2;
+  ic[3] = p3;
+  ic[4] = 0;
+}
+
+// 1か所書き換えたら1を返す（命令の位置がずれるので、呼び出し元は最初から探し直す）
+int reduceInductionVariable()
+{
+  for (int p = 0; p < nIc; ++p) {
+    IntPtr *lop = icAt(p);
+    if ((Opcode) lop[0] != OpLop)
+      continue;
+    int t = jumpTarget(lop), iv = slotOf(lop[2]);
+    if (t > p || isDefinedIn(iv, t, p) || !isSingleEntryLoop(t, p))
+      continue;
+
+    for (int k = t; k < p; ++k) {
+      IntPtr *ic = icAt(k);
+      if ((Opcode) ic[0] != OpMul)
+        continue;
+      int a = slotOf(ic[2]), w = slotOf(ic[3]);
+      if (a != iv) {
+        w = a;
+        a = slotOf(ic[3]);
+      }
+      if (a != iv || w == iv || isDefinedIn(w, t, p + 1))
+        continue;
+      int k0 = ivAlloc(), def = slotOf(ic[1]);
+      if (k0 < 0 || !insertIc(p, 1, 0) || !insertIc(t, 1, 1))
+        return 0;
+      setIc(icAt(t), OpMul, &vars[k0], &vars[iv], &vars[w]);
+      setIc(icAt(k + 1), OpCpy, &vars[def], &vars[k0], 0);
+      setIc(icAt(p + 1), OpAdd, &vars[k0], &vars[k0], &vars[w]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  ベクトル化
+
+  本体が配列の要素ごとの計算だけのOpLopのループ
+
+    L: t0 = b[i]; t1 = c[i]; t2 = t0 op t1; a[i] = t2; OpLop L, i, n  （a[i] = b[i] op c[i]）
+    L: t0 = b[i]; t1 = t0 op k; a[i] = t1; OpLop L, i, n            （a[i] = b[i] op k、k op b[i]も）
+    L: t0 = b[i]; a[i] = t0; OpLop L, i, n                           （a[i] = b[i]）
+    L: a[i] = k; OpLop L, i, n                                       （a[i] = k）
+    L: t0 = b[i]; s = s + t0; OpLop L, i, n                          （総和）
+    L: t0 = b[i]; t1 = c[i]; t2 = t0 * t1; s = s + t2; OpLop L, i, n （内積）
+
+  を、1つのOpVecMapかOpVecSum（続くOpPrmにbとc、もしくはk）に置き換え、SIMDの命令でまとめて計算する。
+  opは+, -, *, &。a, b, c, k, s, nはbodyの中で書き換えられず、t0...は文をまたがない変数であること。
+  aとbが同じ場所を指していれば同じ添字どうしの計算なので、まとめて読んでからまとめて書いても
+  元のループと同じ結果になる。c = a - 8;のようにずらした場所を指していて範囲が重なるときは、
+  前の周回で書いた値を読むかもしれないので、vecMap()は実行するときに調べて1つずつ順に計算する。
+  元のループと同じく、入ったときに少なくとも1回はbodyを実行し、終わったらiはnになる（n <= iならi + 1）。
+*/
+enum { VecArrays, VecScalar, VecScalarLeft, VecCopy, VecFill, VecSum, VecDot }; // 置き換えたループの形
+
+#if defined(__GNUC__)
+typedef intptr_t VecInt __attribute__((vector_size(32)));
+#define VEC_LANES ((intptr_t) (sizeof(VecInt) / sizeof(intptr_t)))
+#define VEC_LOAD(v, p) memcpy(&(v), (p), sizeof(VecInt))
+#define VEC_STORE(p, v) memcpy((p), &(v), sizeof(VecInt))
+#if defined(__x86_64__) && defined(__linux__)
+#define VEC_KERNEL __attribute__((target_clones("avx2", "default"))) // 実行するCPUに合わせて選ぶ
+#endif
+#endif
+#if !defined(VEC_KERNEL)
+#define VEC_KERNEL
+#endif
+
+// a[i...end) = b op y（yはc[i]かk）。SIMDの幅ごとにまとめて読んでから書き、残りは1つずつ
+#if defined(__GNUC__)
+#define VEC_MAP(OP) \
+  do { \
+    intptr_t *c = (intptr_t *) y; \
+    VecInt u, v; \
+    if (form == VecArrays) { \
+      for (; i + VEC_LANES <= end; i += VEC_LANES) { VEC_LOAD(u, &b[i]); VEC_LOAD(v, &c[i]); u = u OP v; VEC_STORE(&a[i], u); } \
+      for (; i < end; ++i) a[i] = b[i] OP c[i]; \
+    } \
+    else if (form == VecScalar) { \
+      for (; i + VEC_LANES <= end; i += VEC_LANES) { VEC_LOAD(u, &b[i]); u = u OP y; VEC_STORE(&a[i], u); } \
+      for (; i < end; ++i) a[i] = b[i] OP y; \
+    } \
+    else { \
+      for (; i + VEC_LANES <= end; i += VEC_LANES) { VEC_LOAD(u, &b[i]); u = y OP u; VEC_STORE(&a[i], u); } \
+      for (; i < end; ++i) a[i] = y OP b[i]; \
+    } \
+  } while (0)
+#endif
+#define SCALAR_MAP(OP) \
+  do { \
+    intptr_t *c = (intptr_t *) y; \
+    for (; i < end; ++i) \
+      a[i] = form == VecArrays ? b[i] OP c[i] : form == VecScalar ? b[i] OP y : y OP b[i]; \
+  } while (0)
+#if !defined(VEC_MAP)
+#define VEC_MAP(OP) SCALAR_MAP(OP)
+#endif
+
+// aとbが違う場所を指していて、[i, end)の範囲が重なるか
+inline static int overlaps(intptr_t *a, intptr_t *b, intptr_t i, intptr_t end)
+{
+  return a != b && (uintptr_t) &a[i] < (uintptr_t) &b[end] && (uintptr_t) &b[i] < (uintptr_t) &a[end];
+}
+
+VEC_KERNEL static void vecMap(int form, Opcode op, intptr_t *a, intptr_t *b, intptr_t y, intptr_t i, intptr_t end)
+{
+  if (form == VecFill) {
+    for (; i < end; ++i)
+      a[i] = y;
+    return;
+  }
+  if (overlaps(a, b, i, end) || form == VecArrays && overlaps(a, (intptr_t *) y, i, end)) { // 元のループと同じ順に1つずつ
+    if (form == VecCopy) {
+      for (; i < end; ++i)
+        a[i] = b[i];
+      return;
+    }
+    switch (op) {
+    case OpAdd:  SCALAR_MAP(+); break;
+    case OpSub:  SCALAR_MAP(-); break;
+    case OpMul:  SCALAR_MAP(*); break;
+    case OpBand: SCALAR_MAP(&); break;
+    default: break;
+    }
+    return;
+  }
+  if (form == VecCopy) {
+    memcpy(&a[i], &b[i], (end - i) * sizeof(intptr_t));
+    return;
+  }
+  switch (op) {
+  case OpAdd:  VEC_MAP(+); break;
+  case OpSub:  VEC_MAP(-); break;
+  case OpMul:  VEC_MAP(*); break;
+  case OpBand: VEC_MAP(&); break;
+  default: break;
+  }
+}
+
+VEC_KERNEL static intptr_t vecSum(int form, intptr_t *b, intptr_t *c, intptr_t s, intptr_t i, intptr_t end)
+{
+#if defined(__GNUC__)
+  VecInt acc = {0}, u, v;
+  for (; i + VEC_LANES <= end; i += VEC_LANES) {
+    VEC_LOAD(u, &b[i]);
+    if (form == VecDot) {
+      VEC_LOAD(v, &c[i]);
+      u = u * v;
+    }
+    acc += u;
+  }
+  for (int lane = 0; lane < VEC_LANES; ++lane)
+    s += acc[lane];
+#endif
+  for (; i < end; ++i)
+    s += form == VecDot ? b[i] * c[i] : b[i];
+  return s;
+}
+
+inline static int isLoadOf(IntPtr *ic, int iv) // t = b[i]
+{
+  return (Opcode) ic[0] == OpAryGet && slotOf(ic[2]) == iv && isScratch(slotOf(ic[3]));
+}
+
+inline static int isVecOp(Opcode op)
+{
+  return op == OpAdd || op == OpSub || op == OpMul || op == OpBand;
+}
+
+// 「s = s + t」（sをループで足し込む）ならsを返す（でなければ-1）
+inline static int accumulator(IntPtr *ic, int t)
+{
+  if ((Opcode) ic[0] != OpAdd)
+    return -1;
+  int s = slotOf(ic[1]);
+  if (slotOf(ic[2]) == s && slotOf(ic[3]) == t || slotOf(ic[2]) == t && slotOf(ic[3]) == s)
+    return s;
+  return -1;
+}
+
+// 置き換えたら1を返す
+int vectorizeLoop(int p)
+{
+  IntPtr *lop = icAt(p), *ic[4];
+  int t = jumpTarget(lop), len = p - t, iv = slotOf(lop[2]), n = slotOf(lop[3]);
+  if (t > p || len < 1 || len > 4 || iv == n || isDefinedIn(n, t, p) || !isSingleEntryLoop(t, p))
+    return 0;
+  for (int k = 0; k < len; ++k)
+    ic[k] = icAt(t + k);
+
+  int form = -1, a = -1, b = -1, c = -1, s = -1;
+  Opcode op = OpAdd;
+  IntPtr *last = ic[len - 1];
+  int isStore = (Opcode) last[0] == OpArySet && slotOf(last[2]) == iv, value = slotOf(last[3]);
+  if (len == 1 && isStore) {
+    form = VecFill;
+    c = value;
+  }
+  else if (len == 2 && isLoadOf(ic[0], iv)) {
+    int t0 = slotOf(ic[0][3]);
+    b = slotOf(ic[0][1]);
+    if (isStore && value == t0)
+      form = VecCopy;
+    else if ((s = accumulator(last, t0)) >= 0)
+      form = VecSum;
+  }
+  else if (len == 3 && isLoadOf(ic[0], iv) && isStore && isVecOp((Opcode) ic[1][0]) && slotOf(ic[1][1]) == value && isScratch(value)) {
+    int t0 = slotOf(ic[0][3]), x = slotOf(ic[1][2]), y = slotOf(ic[1][3]);
+    b = slotOf(ic[0][1]);
+    op = (Opcode) ic[1][0];
+    if (x == t0 && y != t0)
+      form = VecScalar, c = y;
+    else if (y == t0 && x != t0)
+      form = op == OpSub ? VecScalarLeft : VecScalar, c = x;
+  }
+  else if (len == 4 && isLoadOf(ic[0], iv) && isLoadOf(ic[1], iv) && isVecOp((Opcode) ic[2][0]) && isScratch(slotOf(ic[2][1]))) {
+    int t0 = slotOf(ic[0][3]), t1 = slotOf(ic[1][3]), x = slotOf(ic[2][2]), y = slotOf(ic[2][3]), t2 = slotOf(ic[2][1]);
+    op = (Opcode) ic[2][0];
+    if (t0 != t1 && (x == t0 && y == t1 || x == t1 && y == t0)) {
+      b = slotOf(ic[x == t0 ? 0 : 1][1]);
+      c = slotOf(ic[x == t0 ? 1 : 0][1]);
+      if (isStore && value == t2)
+        form = VecArrays;
+      else if (op == OpMul && (s = accumulator(last, t2)) >= 0)
+        form = VecDot;
+    }
+  }
+  if (form < 0)
+    return 0;
+  if (isStore)
+    a = slotOf(last[1]);
+
+  // 配列と値はループ不変で、足し込む先はそれらと別の変数であること
+  int invariants[3] = {a, b, c};
+  for (int k = 0; k < 3; ++k) {
+    if (invariants[k] >= 0 && (invariants[k] == iv || isDefinedIn(invariants[k], t, p)))
+      return 0;
+  }
+  if (s >= 0 && (s == iv || s == n || s == b || s == c || isScratch(s)))
+    return 0;
+
+  int isSum = form == VecSum || form == VecDot;
+  setIc(icAt(t), isSum ? OpVecSum : OpVecMap, &vars[iv], &vars[n], &vars[isSum ? s : a]);
+  icAt(t)[4] = (IntPtr) (intptr_t) (form | op << 8 | (len + 1) * 5 << 16);
+  if (b < 0)
+    b = a;
+  setIc(icAt(t + 1), OpPrm, &vars[b], &vars[c >= 0 ? c : b], &vars[b]);
+  icAt(t + 1)[4] = &vars[b];
+  for (int k = t + 2; k <= p; ++k)
+    makeNop(icAt(k));
+  return 1;
+}
+
+void vectorizeLoops()
+{
+  int nChanged = 0;
+  for (int p = 0; p < nIc; ++p) {
+    if ((Opcode) icAt(p)[0] == OpLop)
+      nChanged += vectorizeLoop(p);
+  }
+  if (nChanged > 0)
+    compactIc();
+}
+
+/*
+  即値の命令
+
+  最適化の最後に、右の被演算子（配列の添字）が定数の命令を、その値を命令に直接持つ命令に置き換える。
+  定数もvars[]に置かれているので、そのままでは実行のたびにポインタを通して読むことになる。
+  左の被演算子が定数なら、入れ替えてよい命令（比較は向きを変える）は入れ替えてから置き換える。
+*/
+const Opcode immediateOps[OpPrm] = { // 即値の命令がなければOpEnd
+  [OpCeq] = OpCeqI, [OpCne] = OpCneI, [OpClt] = OpCltI, [OpCge] = OpCgeI, [OpCle] = OpCleI, [OpCgt] = OpCgtI,
+  [OpAdd] = OpAddI, [OpSub] = OpSubI, [OpMul] = OpMulI, [OpBand] = OpBandI, [OpShr] = OpShrI,
+  [OpJeq] = OpJeqI, [OpJne] = OpJneI, [OpJlt] = OpJltI, [OpJge] = OpJgeI, [OpJle] = OpJleI, [OpJgt] = OpJgtI,
+  [OpLop] = OpLopI, [OpAryGet] = OpAryGetI, [OpArySet] = OpArySetI,
+};
+
+const Opcode swappedOps[OpPrm] = { // 被演算子を入れ替えたときの命令（入れ替えられなければOpEnd）
+  [OpCeq] = OpCeq, [OpCne] = OpCne, [OpClt] = OpCgt, [OpCge] = OpCle, [OpCle] = OpCge, [OpCgt] = OpClt,
+  [OpAdd] = OpAdd, [OpMul] = OpMul, [OpBand] = OpBand,
+  [OpJeq] = OpJeq, [OpJne] = OpJne, [OpJlt] = OpJgt, [OpJge] = OpJle, [OpJle] = OpJge, [OpJgt] = OpJlt,
+};
+
+void useImmediates()
+{
+  markDefined();
+  for (int k = 0; k < nIc; ++k) {
+    IntPtr *ic = icAt(k);
+    Opcode op = (Opcode) ic[0];
+    if (op >= OpPrm || immediateOps[op] == OpEnd)
+      continue;
+    int right = op == OpAryGet || op == OpArySet ? 2 : 3; // 配列は添字
+    if (swappedOps[op] != OpEnd && !isConstSlot(slotOf(ic[3])) && isConstSlot(slotOf(ic[2]))) {
+      IntPtr t = ic[2];
+      ic[2] = ic[3];
+      ic[3] = t;
+      ic[0] = (IntPtr) (op = swappedOps[op]);
+    }
+    if (!isConstSlot(slotOf(ic[right])))
+      continue;
+    ic[right] = (IntPtr) vars[slotOf(ic[right])];
+    ic[0] = (IntPtr) immediateOps[op];
+  }
+}
+
+/*
+  ループ展開
+
+  本体が分岐を含まない短いOpLopのループ
+
+    L: body; OpLop L, i, n
+
+  を、次のように書き換える（body中でiとnは書き換えられないこと）。
+
+       lim = n - (U - 1); if (i >= lim) goto R;
+    M: body; i++; body; i++; ... body; OpLop M, i, lim   （bodyをU回）
+       if (i >= n) goto E;
+    R: body; OpLop R, i, n
+    E:
+
+  元のループと同じく、入ったときに少なくとも1回はbodyを実行する。
+*/
+#define MAX_UNROLL 16
+#define MAX_UNROLL_BODY 8
+int unrollFactor = 4; // 1以下なら展開しない
+
+int tmpLabelAlloc();
+
+inline static void emitIc(int *pos, Opcode op, IntPtr p1, IntPtr p2, IntPtr p3)
+{
+  setIc(icAt(*pos), op, p1, p2, p3);
+  ++*pos;
+}
+
+// 展開したら、展開したコードの次の命令の位置を返す（展開しなければ0）
+int unrollLoop(int p)
+{
+  IntPtr *lop = icAt(p);
+  int t = jumpTarget(lop), len = p - t, iv = slotOf(lop[2]), n = slotOf(lop[3]), u = unrollFactor;
+  if (t > p || len < 1 || len > MAX_UNROLL_BODY || iv == n)
+    return 0;
+  for (int k = t; k < p; ++k) {
+    Opcode op = (Opcode) icAt(k)[0];
+    if (isTerminator(op) || op == OpPrm || op == OpNop)
+      return 0;
+  }
+  if (isDefinedIn(iv, t, p) || isDefinedIn(n, t, p + 1) || !isSingleEntryLoop(t, p))
+    return 0;
+
+  int lim = isConstSlot(n) ? constSlot(vars[n] - (u - 1)) : ivAlloc();
+  int uMinus1 = constSlot(u - 1);
+  if (lim < 0 || uMinus1 < 0 || nTokenCodes + 3 > MAX_TOKEN_CODE)
+    return 0;
+  int labelM = tmpLabelAlloc(), labelR = tmpLabelAlloc(), labelE = tmpLabelAlloc();
+
+  int size = (isConstSlot(n) ? 0 : 1) + 1 + (u * len + u - 1 + 1) + 1 + (len + 1);
+  IntPtr body[MAX_UNROLL_BODY * 5];
+  int bodyTok[MAX_UNROLL_BODY];
+  memcpy(body, icAt(t), len * 5 * sizeof(IntPtr));
+  memcpy(bodyTok, &icTok[t], len * sizeof(int));
+  if (!insertIc(t, size - (len + 1), 1))
+    return 0;
+
+  int pos = t;
+  if (!isConstSlot(n))
+    emitIc(&pos, OpSub, &vars[lim], &vars[n], &vars[uMinus1]);
+  emitIc(&pos, OpJge, &vars[labelR], &vars[iv], &vars[lim]);
+  vars[labelM] = pos * 5;
+  for (int c = 0; c < u; ++c) {
+    if (c > 0)
+      emitIc(&pos, OpAdd1, &vars[iv], 0, 0);
+    memcpy(icAt(pos), body, len * 5 * sizeof(IntPtr));
+    memcpy(&icTok[pos], bodyTok, len * sizeof(int));
+    pos += len;
+  }
+  emitIc(&pos, OpLop, &vars[labelM], &vars[iv], &vars[lim]);
+  emitIc(&pos, OpJge, &vars[labelE], &vars[iv], &vars[n]);
+  vars[labelR] = pos * 5;
+  memcpy(icAt(pos), body, len * 5 * sizeof(IntPtr));
+  memcpy(&icTok[pos], bodyTok, len * sizeof(int));
+  pos += len;
+  emitIc(&pos, OpLop, &vars[labelR], &vars[iv], &vars[n]);
+  vars[labelE] = pos * 5;
+  assert(pos == t + size);
+  return pos;
+}
+
+void unrollLoops()
+{
+  if (unrollFactor <= 1)
+    return;
+  if (unrollFactor > MAX_UNROLL)
+    unrollFactor = MAX_UNROLL;
+  for (int p = 0; p < nIc; ++p) {
+    int end;
+    if ((Opcode) icAt(p)[0] == OpLop && (end = unrollLoop(p)) > 0)
+      p = end - 1;
+  }
+}
+
+void cleanUp()
+{
+  for (int pass = 0; pass < 2; ++pass) {
+    if (!buildBlocks())
+      break;
+    localValueNumbering();
+    removeOverwrittenStores();
+    while (deadStoreElimination())
+      ;
+    compactIc();
+    removeJumpsToNext();
+    compactIc();
+  }
+}
+
+// internalCode[0...n)を最適化して、新しい命令数を返す
+int optimize(int n)
+{
+  nIc = n;
+  if (optLevel <= 0 || !buildBlocks())
+    return n;
+  markDefined();
+  constProp();
+  compactIc();
+  cleanUp();
+
+  ivNo = 0;
+  while (reduceInductionVariable())
+    ;
+  if (ivNo > 0 && buildBlocks()) { // ループの手前に置いた掛け算を畳み込む
+    markDefined();
+    constProp();
+    compactIc();
+  }
+  markDefined();
+  reduceDivision();
+  cleanUp();
+  vectorizeLoops();
+  unrollLoops();
+  useImmediates();
+  return nIc;
+}
+
+// ソースコードと内部コードの命令列から求めるハッシュ値（FNV-1a）
+intptr_t hashCode(String src, IntPtr *end)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (String p = src; *p != 0; ++p)
+    h = (h ^ *p) * 1099511628211ULL;
+  for (IntPtr *ic = internalCode; ic < end; ic += 5)
+    h = (h ^ (intptr_t) ic[0]) * 1099511628211ULL;
+  return (intptr_t) h;
+}
+
+int timerIndex(intptr_t name);
+
+/*
+  遅延コンパイル（--lazy）
+
+  if文やelse節、ループの本体は、中身をコンパイルせずにトークンの範囲だけを持つOpLazyを置いておく。
+  exec()が初めてOpLazyに来たら、その範囲を内部コードの末尾（codeEnd）にコンパイルし、最後に
+  OpLazyの次へ戻るgotoを付けて、OpLazyをそこへのgotoに書き換える。実行されない本体はコンパイルされない。
+  外へ飛び出す文（break, continue, goto）やラベル、snapshotを含む本体は、その場でコンパイルする。
+  OpLazyの先が見えないので、遅延コンパイルでは最適化はしない。
+*/
+int isLazy;
+
+// tc[pc]から対応する「}」の位置を返す（遅延コンパイルできない本体なら-1）
+int lazyBodyEnd(int pc)
+{
+  for (int depth = 0; tc[pc] != Period; ++pc) {
+    switch (tc[pc]) {
+    case Lbrace:
+      ++depth;
+      break;
+    case Rbrace:
+      if (depth-- == 0)
+        return pc;
+      break;
+    case Break: case Continue: case Goto: case Colon: case Snapshot:
+      return -1;
+    }
+  }
+  return -1;
+}
+
+// 本体がtc[pc]から始まるなら、そこにOpLazyを置いて、本体の後の「}」の位置を返す
+int putLazy(int pc)
+{
+  int end = isLazy ? lazyBodyEnd(pc) : -1;
+  if (end < 0)
+    return pc;
+  putIc(OpLazy, (IntPtr) (intptr_t) pc, (IntPtr) (intptr_t) end, 0, 0);
+  return end;
+}
+
+// tc[pc...end)の文をコンパイルして、icpから後ろに置く（エラーなら-1）
+int compileStatements(int pc, int end)
+{
+  int *curBlock = initBlockInfo(), *loopBlock = NULL;
+  while (pc < end) {
+    int e0 = 0, e2 = 0;
+    curTok = pc;
+    if (match(PhCpy, pc)) {
+      putIc(OpCpy, &vars[tc[wpc[0]]], &vars[tc[wpc[1]]], 0, 0);
+    }
+    else if (match(PhIncJump, pc) && tc[wpc[0]] == tc[wpc[1]] && tc[wpc[0]] == tc[wpc[2]]) {
+      putIc(OpLop, &vars[tc[wpc[4]]], &vars[tc[wpc[0]]], &vars[tc[wpc[3]]], 0);
+    }
+    else if (match(PhInc, pc) && tc[wpc[0]] == tc[wpc[1]]) { // +1専用の命令
+      putIc(OpAdd1, &vars[tc[wpc[0]]], 0, 0, 0);
+    }
+    else if (match(PhArith, pc) && Equal <= tc[wpc[2]] && tc[wpc[2]] < Assign) { // 加算、減算など
+      putIc(OpCeq + tc[wpc[2]] - Equal, &vars[tc[wpc[0]]], &vars[tc[wpc[1]]], &vars[tc[wpc[3]]], 0);
+    }
+    else if (match(PhPrint, pc)) {
+      exprsPutIc(1, OpPrint, 0, &e0);
+    }
+    else if (match(PhLabel, pc)) { // ラベル定義命令
+      vars[tc[wpc[0]]] = icp - internalCode; // ラベル名の変数にその時のicpの相対位置を入れておく
+    }
+    else if (match(PhGoto, pc)) {
+      putIc(OpGoto, &vars[tc[wpc[0]]], &vars[tc[wpc[0]]], 0, 0);
+    }
+    else if (match(PhIfGoto, pc)) {
+      ifgoto(0, ConditionIsTrue, tc[wpc[1]]);
+    }
+    else if (match(PhTime, pc)) {
+      putIc(OpTime, 0, 0, 0, 0);
+    }
+    else if (match(PhTimerReport, pc)) {
+      putIc(OpTimerReport, 0, 0, 0, 0);
+    }
+    else if (match(PhTimer, pc) || match(PhTimerStop, pc)) { // 名前付きの区間の計測
+      int t = isStringSlot(tc[wpc[0]]) ? timerIndex(vars[tc[wpc[0]]]) : -1;
+      if (t < 0)
+        goto err;
+      putIc(tc[pc] == Timer ? OpTimerStart : OpTimerStop, (IntPtr) (intptr_t) t, 0, 0, 0);
+    }
+    else if (match(PhIf, pc)) { // if文
+      curBlock = beginBlock();
+      curBlock[ BlockType ] = IfBlock;
+      curBlock[ IfLabel0  ] = tmpLabelAlloc(); // 条件不成立のときの飛び先
+      curBlock[ IfLabel1  ] = 0;
+      ifgoto(0, ConditionIsFalse, curBlock[IfLabel0]);
+      nextPc = putLazy(nextPc);
+    }
+    else if (match(PhElse, pc) && curBlock[BlockType] == IfBlock) {
+      curBlock[IfLabel1] = tmpLabelAlloc(); // else節の終端
+      putIc(OpGoto, &vars[curBlock[IfLabel1]], &vars[curBlock[IfLabel1]], 0, 0);
+      vars[curBlock[IfLabel0]] = icp - internalCode;
+      nextPc = putLazy(nextPc);
+    }
+    else if (match(PhEnd, pc) && curBlock[BlockType] == IfBlock) {
+      int ifLabel = curBlock[IfLabel1] ? IfLabel1 : IfLabel0;
+      vars[curBlock[ifLabel]] = icp - internalCode;
+      curBlock = endBlock();
+    }
+    else if (match(PhFor, pc)) { // for文
+      curBlock = beginBlock();
+      curBlock[ BlockType    ] = ForBlock;
+      curBlock[ LoopBegin    ] = tmpLabelAlloc();
+      curBlock[ LoopContinue ] = tmpLabelAlloc();
+      curBlock[ LoopBreak    ] = tmpLabelAlloc();
+      startLoop(&loopBlock);
+
+      e0 = expression(0);
+      saveExpr(1);
+      if (wpc[1] < wpc[_end(1)])
+        ifgoto(1, ConditionIsFalse, curBlock[LoopBreak]);
+      saveExpr(2);
+      vars[curBlock[LoopBegin]] = icp - internalCode;
+      nextPc = putLazy(nextPc);
+    }
+    else if (match(PhEnd, pc) && curBlock[BlockType] == ForBlock) {
+      vars[curBlock[LoopContinue]] = icp - internalCode;
+
+      restoreExpr(1);
+      restoreExpr(2);
+      int begin1 = wpc[1], end1 = wpc[_end(1)], begin2 = wpc[2], end2 = wpc[_end(2)];
+      int shouldOptimize =
+        begin1 + 3 == end1 && tc[begin1 + 1] == Les && begin2 + 2 == end2 &&
+        (tc[begin1] == tc[begin2] && tc[begin2 + 1] == PlusPlus ||
+         tc[begin1] == tc[begin2 + 1] && tc[begin2] == PlusPlus);
+
+      if (shouldOptimize)
+        putIc(OpLop, &vars[curBlock[LoopBegin]], &vars[tc[begin1]], &vars[tc[begin1 + 2]], 0);
+      else {
+        e2 = expression(2);
+        if (begin1 < end1)
+          ifgoto(1, ConditionIsTrue, curBlock[LoopBegin]);
+        else
+          putIc(OpGoto, &vars[curBlock[LoopBegin]], &vars[curBlock[LoopBegin]], 0, 0);
+      }
+      vars[curBlock[LoopBreak]] = icp - internalCode;
+
+      stopLoop(&loopBlock);
+      curBlock = endBlock();
+    }
+    else if (match(PhWhile, pc)) { // while文
+      curBlock = beginBlock();
+      curBlock[ BlockType    ] = WhileBlock;
+      curBlock[ LoopBegin    ] = tmpLabelAlloc();
+      curBlock[ LoopContinue ] = tmpLabelAlloc();
+      curBlock[ LoopBreak    ] = tmpLabelAlloc();
+      startLoop(&loopBlock);
+
+      saveExpr(1);
+      ifgoto(1, ConditionIsFalse, curBlock[LoopBreak]);
+      vars[curBlock[LoopBegin]] = icp - internalCode;
+      nextPc = putLazy(nextPc);
+    }
+    else if (match(PhEnd, pc) && curBlock[BlockType] == WhileBlock) {
+      vars[curBlock[LoopContinue]] = icp - internalCode;
+
+      restoreExpr(1);
+      ifgoto(1, ConditionIsTrue, curBlock[LoopBegin]);
+      vars[curBlock[LoopBreak]] = icp - internalCode;
+
+      stopLoop(&loopBlock);
+      curBlock = endBlock();
+    }
+    else if (match(PhContinue, pc) && loopBlock) {
+      putIc(OpGoto, &vars[loopBlock[LoopContinue]], &vars[loopBlock[LoopContinue]], 0, 0);
+    }
+    else if (match(PhBreak, pc) && loopBlock) {
+      putIc(OpGoto, &vars[loopBlock[LoopBreak]], &vars[loopBlock[LoopBreak]], 0, 0);
+    }
+    else if (match(PhIfContinue, pc) && loopBlock) {
+      ifgoto(0, ConditionIsTrue, loopBlock[LoopContinue]);
+    }
+    else if (match(PhIfBreak, pc) && loopBlock) {
+      ifgoto(0, ConditionIsTrue, loopBlock[LoopBreak]);
+    }
+    else if (match(PhPrints, pc)) {
+      exprsPutIc(1, OpPrints, 0, &e0);
+    }
+    else if (match(PhSnapshot, pc)) {
+      putIc(OpSnapshot, &vars[tc[wpc[0]]], 0, 0, 0);
+    }
+    else if (match(PhMmap, pc)) { // ファイルを配列として写像する（書き換えるとコピーされる）
+      isDynArray[tc[wpc[0]]] = isConstArray[tc[wpc[0]]] = 0;
+      putIc(OpAryMap, &vars[tc[wpc[0]]], &vars[tc[wpc[2]]], 0, 0);
+      putIc(OpAryLen, &vars[tc[wpc[1]]], &vars[tc[wpc[0]]], 0, 0);
+    }
+    else if (match(PhConstMmap, pc)) { // 読み出し専用（書き込む文はコンパイルエラーにする）
+      isDynArray[tc[wpc[0]]] = 0;
+      isConstArray[tc[wpc[0]]] = 1;
+      putIc(OpAryMap, &vars[tc[wpc[0]]], &vars[tc[wpc[2]]], 0, 0);
+      putIc(OpAryLen, &vars[tc[wpc[1]]], &vars[tc[wpc[0]]], 0, 0);
+    }
+    else if (match(PhInputAry, pc)) { // 最大で!!**1個の整数を読み込み、読めた数を!!*2に入れる
+      e0 = expression(1);
+      putIc(OpInputAry, &vars[tc[wpc[2]]], &vars[writableArray(tc[wpc[0]])], &vars[e0], 0);
+    }
+    else if (match(PhInput, pc)) {
+      putIc(OpInput, &vars[tc[wpc[0]]], 0, 0, 0);
+    }
+    else if (match(PhAryDyn, pc)) { // 可変長配列
+      isDynArray[tc[wpc[0]]] = 1;
+      isConstArray[tc[wpc[0]]] = 0;
+      putIc(OpAryDyn, &vars[tc[wpc[0]]], 0, 0, 0);
+    }
+    else if (match(PhPush, pc)) {
+      e0 = expression(1);
+      putIc(OpPush, &vars[dynArray(tc[wpc[0]])], &vars[e0], 0, 0);
+    }
+    else if (match(PhReserve, pc)) {
+      e0 = expression(1);
+      putIc(OpReserve, &vars[dynArray(tc[wpc[0]])], &vars[e0], 0, 0);
+    }
+    else if (match(PhMapNew, pc)) { // 連想配列
+      isDynArray[tc[wpc[0]]] = isConstArray[tc[wpc[0]]] = 0;
+      putIc(OpMapNew, &vars[tc[wpc[0]]], 0, 0, 0);
+    }
+    else if (match(PhMapPut, pc)) {
+      exprsPutIc(3, OpMapPut, 0, &e0);
+    }
+    else if (match(PhMapDel, pc)) {
+      exprsPutIc(2, OpMapDel, 0, &e0);
+    }
+    else if (match(PhMapGet, pc)) {
+      e2 = expression(2);
+      putIc(OpMapGet, &vars[tc[wpc[0]]], &vars[tc[wpc[1]]], &vars[e2], 0);
+    }
+    else if (match(PhMapHas, pc)) {
+      e2 = expression(2);
+      putIc(OpMapHas, &vars[tc[wpc[0]]], &vars[tc[wpc[1]]], &vars[e2], 0);
+    }
+    else if (match(PhSort, pc)) { // 先頭から!!**1個を小さい順に並べる
+      writableArray(tc[wpc[0]]);
+      exprsPutIc(2, OpSort, 0, &e0);
+    }
+    else if (match(PhAryNew, pc)) {
+      isDynArray[tc[wpc[0]]] = isConstArray[tc[wpc[0]]] = 0;
+      e2 = expression(2);
+      putIc(OpAryNew, &vars[tc[wpc[0]]], &vars[e2], 0, 0);
+    }
+    else if (match(PhAryInit, pc)) {
+      isDynArray[tc[wpc[0]]] = isConstArray[tc[wpc[0]]] = 0;
+      e2 = expression(2);
+
+      int pc, nElems = 0;
+      for (pc = nextPc; tc[pc] != Rbrace; ++pc) {
+        if (pc >= end)
+          goto err;
+        if (tc[pc] != Comma)
+          ++nElems;
+      }
+      intptr_t *ary = allocMem(MemInit, nElems * sizeof(intptr_t));
+      if (ary == NULL) {
+        memoryLimitExceeded();
+        return -1;
+      }
+
+      nElems = 0;
+      for (pc = nextPc; tc[pc] != Rbrace; ++pc) {
+        if (tc[pc] == Comma)
+          continue;
+        ary[nElems] = vars[tc[pc]];
+        ++nElems;
+      }
+      String size = tokenStrs[e2];
+      Initializer *init = newInitializer(ary, nElems,
+        nElems * sizeof(intptr_t) >= SHARE_MIN_BYTES && isNumber(size[0]) && strtol(size, NULL, 0) == nElems);
+      if (init == NULL)
+        return -1;
+      if (init->fd >= 0)
+        putIc(OpAryShare, &vars[tc[wpc[0]]], (IntPtr) init, (IntPtr) (intptr_t) nElems, 0);
+      else {
+        putIc(OpAryNew, &vars[tc[wpc[0]]], &vars[e2], 0, 0);
+        putIc(OpAryInit, &vars[tc[wpc[0]]], (IntPtr) ary, (IntPtr) nElems, 0);
+      }
+      nextPc = pc + 2; // } と ; の分
+    }
+    else if (match(PhExpr, pc)) {
+      e0 = expression(0);
+    }
+    else {
+      goto err;
+    }
+    tmpFree(e0);
+    tmpFree(e2);
+    if (e0 < 0 || e2 < 0)
+      goto err;
+    if (hasCompileError)
+      return -1;
+    pc = nextPc;
+  }
+  if (blockDepth > 0) {
+    printError("Block nesting error: blockDepth=%d loopDepth=%d\n", blockDepth, loopDepth);
+    return -1;
+  }
+  return 0;
+err:
+  printError("Syntax error: %s %s %s %s\n", tokenStrs[tc[pc]], tokenStrs[tc[pc + 1]], tokenStrs[tc[pc + 2]], tokenStrs[tc[pc + 3]]);
+  return -1;
+}
+
+// [begin, end)の分岐命令の飛び先を、ラベルの位置からアドレスにする
+void resolveJumps(IntPtr *begin, IntPtr *end)
+{
+  for (IntPtr *ic = begin; ic < end; ic += 5) {
+    if (isJump((Opcode) ic[0])) {
+      IntPtr *tmpDest = internalCode + *ic[1];
+      // goto先がOpGotoのときは、さらにその先を読む（L: goto L; のような輪は途中でやめる）
+      for (int hops = 0; (Opcode) tmpDest[0] == OpGoto && hops < (end - internalCode) / 5; ++hops)
+        tmpDest = internalCode + *tmpDest[2];
+      ic[1] = (IntPtr) tmpDest;
+      ic[4] = (IntPtr) (tmpDest <= ic ? ic - tmpDest + 5 : 0); // 後ろ向きの分岐で使う命令数（exec()を参照）
+    }
+  }
+}
+
+/*
+  変数の詰め直し
+
+  変数はトークンコードの番号の位置に置かれるので、よく使う変数が演算子やキーワード、定数、ラベルの間に
+  散らばってしまう。run()はコンパイルした後に、内部コードが使う変数をループの深い所で使うものから順に
+  hotVars[]に詰めて、命令のオペランドをそちらへ向け直す（ラベルとRawのオペランドはそのまま）。
+  値の本体はvars[]なので、exec()の前後とsnapshotの前にloadHotVars()とstoreHotVars()で写し合う。
+*/
+intptr_t hotVars[MAX_TOKEN_CODE + 1];
+int hotSlots[MAX_TOKEN_CODE + 1]; // hotVars[k]の本体はvars[hotSlots[k]]
+int hotIndex[MAX_TOKEN_CODE + 1]; // vars[i]を詰めた先はhotVars[hotIndex[i] - 1]（0なら詰めていない）
+int nHotVars;
+
+inline static int isVarOperand(IntPtr *ic, int i)
+{
+  int kind = operandKind(ic, i);
+  return (kind == OprUse || kind == OprDef || kind == OprUseDef) && vars <= ic[i] && ic[i] <= &vars[MAX_TOKEN_CODE];
+}
+
+// [begin, end)のオペランドをhotVarsに向け直す（まだ詰めていない変数は後ろに足す）
+void redirectVars(IntPtr *begin, IntPtr *end)
+{
+  for (IntPtr *ic = begin; ic < end; ic += 5) {
+    for (int i = 1; i <= 4; ++i) {
+      if (!isVarOperand(ic, i))
+        continue;
+      int slot = slotOf(ic[i]);
+      if (hotIndex[slot] == 0) {
+        hotSlots[nHotVars] = slot;
+        hotVars[nHotVars] = vars[slot];
+        hotIndex[slot] = ++nHotVars;
+      }
+      ic[i] = &hotVars[hotIndex[slot] - 1];
     }
-    else if (match(3, "print !!**0;", pc)) {
-      exprsPutIc(1, OpPrint, 0, &e0);
+  }
+}
+
+int64_t slotWeight[MAX_TOKEN_CODE + 1];
+int slotFirstUse[MAX_TOKEN_CODE + 1];
+
+int compareSlots(const void *a, const void *b)
+{
+  int x = *(const int *) a, y = *(const int *) b;
+  if (slotWeight[x] != slotWeight[y])
+    return slotWeight[x] > slotWeight[y] ? -1 : 1;
+  return slotFirstUse[x] - slotFirstUse[y];
+}
+
+// 分岐先を設定した後の[begin, end)が使う変数をhotVarsに詰める
+void packVars(IntPtr *begin, IntPtr *end)
+{
+  static int depth[sizeof internalCode / sizeof internalCode[0] / 5];
+  int n = (end - begin) / 5, slots[MAX_TOKEN_CODE + 1], nSlots = 0;
+  memset(depth, 0, n * sizeof(int));
+  for (int k = 0; k < n; ++k) { // 後ろ向きの分岐の範囲にある命令はループの中
+    IntPtr *ic = begin + k * 5, *dest = (IntPtr *) ic[1];
+    if (isJump((Opcode) ic[0]) && begin <= dest && dest <= ic) {
+      for (int j = (dest - begin) / 5; j <= k; ++j)
+        ++depth[j];
     }
-    else if (match(4, "!!*0:", pc)) { // ラベル定義命令
-      vars[tc[wpc[0]]] = icp - internalCode; // ラベル名の変数にその時のicpの相対位置を入れておく
+  }
+  memset(slotWeight, 0, sizeof slotWeight);
+  for (int k = n - 1; k >= 0; --k) {
+    IntPtr *ic = begin + k * 5;
+    for (int i = 1; i <= 4; ++i) {
+      if (!isVarOperand(ic, i))
+        continue;
+      int slot = slotOf(ic[i]);
+      if (slotWeight[slot] == 0)
+        slots[nSlots++] = slot;
+      slotWeight[slot] += (int64_t) 1 << (depth[k] < 10 ? depth[k] * 3 : 30); // 1段深いループは8倍
+      slotFirstUse[slot] = k;
     }
-    else if (match(5, "goto !!*0;", pc)) {
-      putIc(OpGoto, &vars[tc[wpc[0]]], &vars[tc[wpc[0]]], 0, 0);
+  }
+  qsort(slots, nSlots, sizeof(int), compareSlots);
+
+  memset(hotIndex, 0, sizeof hotIndex);
+  nHotVars = 0;
+  for (int k = 0; k < nSlots; ++k) {
+    hotSlots[k] = slots[k];
+    hotIndex[slots[k]] = k + 1;
+  }
+  nHotVars = nSlots;
+  redirectVars(begin, end);
+}
+
+inline static void loadHotVars()
+{
+  for (int k = 0; k < nHotVars; ++k)
+    hotVars[k] = vars[hotSlots[k]];
+}
+
+inline static void storeHotVars()
+{
+  for (int k = 0; k < nHotVars; ++k)
+    vars[hotSlots[k]] = hotVars[k];
+}
+
+int compile(String src)
+{
+  int nTokens = lexer(src);
+  if (nTokens < 0)
+    return -1;
+  for (int i = nTokens; i < nTokens + 5; ++i) // 付け足すトークンは最後の行にあることにする
+    tcLine[i] = nTokens > 0 ? tcLine[nTokens - 1] : 1;
+  tc[nTokens++] = Semicolon; // 末尾に「;」を付け忘れることが多いので、付けてあげる
+  tc[nTokens] = tc[nTokens + 1] = tc[nTokens + 2] = tc[nTokens + 3] = Period; // エラー表示用
+
+  icp = internalCode;
+
+  for (int i = 0; i < N_TMPS; ++i)
+    tmpFlags[i] = 0;
+  tmpLabelNo = 0;
+  nHotVars = 0;
+  memset(hotIndex, 0, sizeof hotIndex);
+  hasCompileError = 0;
+  freeInitializers(initializers); // 前のプログラムの分（hrbCompile()が引き取ったものは残っていない）
+  initializers = NULL;
+  int rv = compileStatements(0, nTokens);
+  putIc(OpEnd, 0, 0, 0, 0);
+  if (rv < 0 || hasCompileError) {
+    freeInitializers(initializers);
+    initializers = NULL;
+    return -1;
+  }
+  if (!isLazy)
+    icp = internalCode + optimize((icp - internalCode) / 5) * 5;
+
+  IntPtr *end = icp;
+  resolveJumps(internalCode, end);
+  intptr_t hash = hashCode(src, end);
+  for (icp = internalCode; icp < end; icp += 5) {
+    if ((Opcode) icp[0] == OpSnapshot) { // 再開する位置と、同じプログラムかどうかを確かめるためのハッシュ値
+      icp[2] = (IntPtr) ((icp - internalCode) / 5 + 1);
+      icp[3] = (IntPtr) hash;
     }
-    else if (match(6, "if (!!**0) goto !!*1;", pc)) {
-      ifgoto(0, ConditionIsTrue, tc[wpc[1]]);
+  }
+  codeEnd = end;
+  return end - internalCode;
+}
+
+// exec()が初めてOpLazyに来たときに呼ぶ。本体をコンパイルして、stubをそこへのgotoに書き換える
+int compileLazy(IntPtr *stub)
+{
+  int begin = (intptr_t) stub[1], end = (intptr_t) stub[2];
+  IntPtr *body = icp = codeEnd;
+  hasCompileError = 0;
+  if (compileStatements(begin, end) < 0)
+    return -1;
+  // トークンコードを使わないように、gotoの飛び先の位置（ラベルの値）は命令のp3に置く
+  IntPtr *back = icp;
+  curTok = end;
+  putIc(OpGoto, 0, (IntPtr) &back[3], (IntPtr) (stub + 5 - internalCode), 0);
+  if (hasCompileError)
+    return -1;
+  resolveJumps(body, back);
+  if (nHotVars > 0)
+    redirectVars(body, back);
+  back[1] = (IntPtr) (stub + 5);
+  back[4] = (IntPtr) (icp - body); // 戻るgotoでは、本体を実行した分だけを数える
+  codeEnd = icp;
+
+  stub[1] = (IntPtr) body;
+  stub[2] = (IntPtr) &stub[3];
+  stub[3] = (IntPtr) (body - internalCode);
+  stub[4] = 0;
+  stub[0] = (IntPtr) OpGoto;
+  icp = stub;
+  return 0;
+}
+
+/*
+  実行の打ち切り
+
+  命令数と経過時間の上限は、後ろ向きの分岐（OpGoto, OpJxx, OpLop）を実行するとき
+  だけ調べる。compile()が分岐命令のicp[4]に入れておいた分岐元と分岐先の距離
+  （前向きの分岐なら0）をstepsから引いていき、負になったときだけcheckLimits()を
+  呼んで命令数を集計し、時計を読む。後ろ向きの分岐を通らずに実行できる命令の
+  数は内部コードの長さで抑えられるので、これで十分に止まる。
+
+  yieldStepsを決めておくと、その命令数を実行したところでExitYieldを返す（スケジューラ用）。
+  このときは分岐を済ませてから返すので、icpから続きを実行できる。続きを実行するときは
+  stepsBeforeとtimeBeforeにそれまでの命令数と時間を入れておくと、上限はその合計で調べる。
+*/
+#define STEP_CHECK_INTERVAL (1 << 20) // 時計を読む間隔（命令数）
+
+intptr_t stepLimit;  // 実行できる命令数の上限（0なら無制限）
+double timeLimit;    // 実行できる時間の上限[sec]（0なら無制限）
+intptr_t nSteps;     // exec()が実行した命令数（後ろ向きの分岐で数えた概数）
+intptr_t sliceSteps; // 今の区切りで許した命令数
+intptr_t yieldSteps; // この命令数を実行したら実行を譲る（0なら譲らない）
+intptr_t stepsBefore; // 前のexec()までに実行した命令数（スクリプトの続きを実行するとき）
+double timeBefore;    // 前のexec()までに実行した時間[sec]
+struct timespec execBegin;
+
+inline static double elapsedTime(struct timespec *begin)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - begin->tv_sec) + (now.tv_nsec - begin->tv_nsec) * 1e-9;
+}
+
+// 前のexec()までの分も含めて実行した時間[sec]
+inline static double execTime()
+{
+  return timeBefore + elapsedTime(&execBegin);
+}
+
+inline static void startSlice(intptr_t *steps)
+{
+  sliceSteps = STEP_CHECK_INTERVAL;
+  if (stepLimit > 0 && stepLimit - nSteps < sliceSteps)
+    sliceSteps = stepLimit - nSteps;
+  if (yieldSteps > 0 && yieldSteps - nSteps < sliceSteps)
+    sliceSteps = yieldSteps - nSteps;
+  *steps = sliceSteps * 5;
+}
+
+inline static void countSteps(intptr_t steps)
+{
+  nSteps += sliceSteps - steps / 5;
+}
+
+int checkLimits(intptr_t *steps)
+{
+  countSteps(*steps);
+  if (stepLimit > 0 && nSteps >= stepLimit) {
+    printError("Instruction limit exceeded: %ld\n", (long) stepLimit);
+    return ExitLimitExceeded;
+  }
+  if (timeLimit > 0 && execTime() >= timeLimit) {
+    printError("Time limit exceeded: %.3f[sec]\n", timeLimit);
+    return ExitLimitExceeded;
+  }
+  if (yieldSteps > 0 && nSteps >= yieldSteps) // 譲る前に上限を調べる（区切りが短いと、ここでしか時計を読まない）
+    return ExitYield;
+  startSlice(steps);
+  return 0;
+}
+
+/*
+  配列
+
+  OpAryNewで確保した配列はすべてarraysに登録しておく（スナップショットで使う）。
+  確保する関数は、メモリの上限を超えるときはNULLを返す。
+
+  可変長配列（int a[];）は、先頭の前に容量と長さを置く（a[-2]が容量、a[-1]が長さ）。
+  容量が足りなくなったら2倍に広げるので、配列を指す変数の値は変わることがある。
+*/
+enum { ArrayFixed, ArrayDynamic, ArrayMap }; // 配列の種類
+
+typedef struct { intptr_t *p, n; int kind; } ArrayInfo; // 可変長配列のnは容量、連想配列のnは0
+
+ArrayInfo *arrays;
+int nArrays, arraysSize;
+
+// 登録できなければ（表を広げられなければ）isOutOfMemoryを立てて-1を返す
+int registerArray(intptr_t *p, intptr_t n)
+{
+  if (nArrays >= arraysSize) {
+    int size = arraysSize ? arraysSize * 2 : 64;
+    ArrayInfo *q = realloc(arrays, size * sizeof(ArrayInfo));
+    if (q == NULL) {
+      isOutOfMemory = 1;
+      return -1;
     }
-    else if (match(7, "time;", pc)) {
-      putIc(OpTime, 0, 0, 0, 0);
+    arrays = q;
+    arraysSize = size;
+  }
+  arrays[nArrays].p = p;
+  arrays[nArrays].n = n;
+  arrays[nArrays].kind = ArrayFixed;
+  ++nArrays;
+  return 0;
+}
+
+intptr_t *newArray(intptr_t n)
+{
+  size_t size = (n > 0 ? n : 1) * sizeof(intptr_t);
+  intptr_t *p = allocZeroedMem(MemArray, size);
+  if (p == NULL)
+    return NULL;
+  if (registerArray(p, n) < 0) {
+    freeMem(MemArray, p, size);
+    return NULL;
+  }
+  return p;
+}
+
+#define MAX_SHARED_MAPS 4096 // OpAryShareが作る写像の数の上限（超えたらコピーする）
+int nSharedMaps;
+
+// 初期化子の表を、書き換えたページだけコピーする配列として写像する
+// 宣言を実行するたびに新しい写像を作る（前の配列は配列の要素などから指されているかもしれないので使い回さない）
+intptr_t *shareArray(Initializer *init)
+{
+  intptr_t n = init->n, *p;
+  size_t size = n * sizeof(intptr_t);
+#if defined(__APPLE__) || defined(__linux__)
+  if (nSharedMaps < MAX_SHARED_MAPS) {
+    if (memLimit > 0 && memCurrent + (intptr_t) size > memLimit)
+      return NULL;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, init->fd, 0);
+    if (p != MAP_FAILED && registerArray(p, n) < 0) {
+      munmap(p, size);
+      return NULL;
     }
-    else if (match(11, "if (!!**0) {", pc)) { // if文
-      curBlock = beginBlock();
-      curBlock[ BlockType ] = IfBlock;
-      curBlock[ IfLabel0  ] = tmpLabelAlloc(); // 条件不成立のときの飛び先
-      curBlock[ IfLabel1  ] = 0;
-      ifgoto(0, ConditionIsFalse, curBlock[IfLabel0]);
+    if (p != MAP_FAILED) {
+      ++nSharedMaps;
+      memSites[MemArray].nAllocs++;
+      memSites[MemArray].nBlocks++;
+      countMem(MemArray, size); // 書き換えたページはコピーされるので、配列と同じだけ数えておく
+      return p;
     }
-    else if (match(13, "} else {", pc) && curBlock[BlockType] == IfBlock) {
-      curBlock[IfLabel1] = tmpLabelAlloc(); // else節の終端
-      putIc(OpGoto, &vars[curBlock[IfLabel1]], &vars[curBlock[IfLabel1]], 0, 0);
-      vars[curBlock[IfLabel0]] = icp - internalCode;
+  }
+  p = newArray(n);
+  if (p != NULL && pread(init->fd, p, size, 0) != (ssize_t) size) {
+    printError("Failed to read initializer\n");
+    return NULL;
+  }
+#else
+  p = newArray(n);
+#endif
+  return p;
+}
+
+#define DYN_HEADER 2 // 容量と長さ
+
+inline static intptr_t *dynHeader(intptr_t *p)
+{
+  return p - DYN_HEADER;
+}
+
+// 可変長配列の容量をcapacity以上に広げる（広げたら新しい先頭を返す）
+intptr_t *growArray(intptr_t *p, intptr_t capacity)
+{
+  intptr_t newCapacity = p ? p[-2] * 2 : 0;
+  if (newCapacity < 8)
+    newCapacity = 8;
+  if (newCapacity < capacity)
+    newCapacity = capacity;
+  intptr_t oldSize = p ? (p[-2] + DYN_HEADER) * sizeof(intptr_t) : 0;
+  intptr_t *q = reallocMem(MemDynArray, p ? dynHeader(p) : NULL, oldSize, (newCapacity + DYN_HEADER) * sizeof(intptr_t));
+  if (q == NULL)
+    return NULL;
+  q += DYN_HEADER;
+  if (p == NULL) {
+    q[-1] = 0;
+    if (registerArray(q, newCapacity) < 0) {
+      freeMem(MemDynArray, dynHeader(q), (newCapacity + DYN_HEADER) * sizeof(intptr_t));
+      return NULL;
     }
-    else if (match(12, "}", pc) && curBlock[BlockType] == IfBlock) {
-      int ifLabel = curBlock[IfLabel1] ? IfLabel1 : IfLabel0;
-      vars[curBlock[ifLabel]] = icp - internalCode;
-      curBlock = endBlock();
+    arrays[nArrays - 1].kind = ArrayDynamic;
+  }
+  else {
+    for (int a = nArrays - 1; a >= 0; --a) {
+      if (arrays[a].p == p) {
+        arrays[a].p = q;
+        arrays[a].n = newCapacity;
+        break;
+      }
     }
-    else if (match(14, "for (!!***0; !!***1; !!***2) {", pc)) { // for文
-      curBlock = beginBlock();
-      curBlock[ BlockType    ] = ForBlock;
-      curBlock[ LoopBegin    ] = tmpLabelAlloc();
-      curBlock[ LoopContinue ] = tmpLabelAlloc();
-      curBlock[ LoopBreak    ] = tmpLabelAlloc();
-      startLoop(&loopBlock);
+  }
+  q[-2] = newCapacity;
+  return q;
+}
 
-      e0 = expression(0);
-      saveExpr(1);
-      if (wpc[1] < wpc[_end(1)])
-        ifgoto(1, ConditionIsFalse, curBlock[LoopBreak]);
-      saveExpr(2);
-      vars[curBlock[LoopBegin]] = icp - internalCode;
+// 長さnの可変長配列
+intptr_t *newDynArray(intptr_t n)
+{
+  intptr_t *p = growArray(NULL, n);
+  if (p != NULL)
+    p[-1] = n;
+  return p;
+}
+
+/*
+  連想配列（map m;）
+
+  キーと値の組を1つの配列に並べたオープンアドレス法のハッシュ表。
+  衝突したら隣を調べ（線形探索）、削除では後ろの組を詰めるので墓標は使わない。
+  MAP_EMPTYは空きの印なので、このキーの組だけは表の外に持つ。
+*/
+#define MAP_EMPTY INTPTR_MIN
+
+typedef struct { intptr_t key, value; } MapEntry;
+
+typedef struct {
+  MapEntry *entries;
+  intptr_t capacity, n; // capacityは2のべき乗
+  int shift;            // ハッシュ値の上位ビットを使うためのシフト量
+  int hasEmptyKey;
+  intptr_t emptyKeyValue;
+} Map;
+
+inline static intptr_t mapIndex(Map *m, intptr_t key)
+{
+  return (intptr_t) (((uint64_t) key * 0x9e3779b97f4a7c15ULL) >> m->shift); // Fibonacci hashing
+}
+
+int initMapEntries(Map *m, intptr_t capacity)
+{
+  m->entries = allocMem(MemMap, capacity * sizeof(MapEntry));
+  if (m->entries == NULL)
+    return 0;
+  for (intptr_t i = 0; i < capacity; ++i)
+    m->entries[i].key = MAP_EMPTY;
+  m->capacity = capacity;
+  m->n = 0;
+  m->shift = 64;
+  for (intptr_t c = capacity; c > 1; c >>= 1)
+    --m->shift;
+  return 1;
+}
+
+Map *newMap()
+{
+  Map *m = allocZeroedMem(MemMap, sizeof(Map));
+  if (m == NULL)
+    return NULL;
+  if (!initMapEntries(m, 16)) {
+    freeMem(MemMap, m, sizeof(Map));
+    return NULL;
+  }
+  if (registerArray((intptr_t *) m, 0) < 0) {
+    freeMem(MemMap, m->entries, m->capacity * sizeof(MapEntry));
+    freeMem(MemMap, m, sizeof(Map));
+    return NULL;
+  }
+  arrays[nArrays - 1].kind = ArrayMap;
+  return m;
+}
+
+// keyの組、もしくはkeyを入れる空きを返す
+inline static MapEntry *findEntry(Map *m, intptr_t key)
+{
+  intptr_t mask = m->capacity - 1;
+  for (intptr_t i = mapIndex(m, key);; i = (i + 1) & mask) {
+    MapEntry *e = &m->entries[i];
+    if (e->key == key || e->key == MAP_EMPTY)
+      return e;
+  }
+}
+
+int growMap(Map *m)
+{
+  MapEntry *old = m->entries;
+  intptr_t oldCapacity = m->capacity, oldN = m->n;
+  int oldShift = m->shift;
+  if (!initMapEntries(m, oldCapacity * 2)) {
+    m->entries = old;
+    m->capacity = oldCapacity;
+    m->n = oldN;
+    m->shift = oldShift;
+    return 0;
+  }
+  for (intptr_t i = 0; i < oldCapacity; ++i) {
+    if (old[i].key != MAP_EMPTY) {
+      *findEntry(m, old[i].key) = old[i];
+      ++m->n;
     }
-    else if (match(12, "}", pc) && curBlock[BlockType] == ForBlock) {
-      vars[curBlock[LoopContinue]] = icp - internalCode;
+  }
+  freeMem(MemMap, old, oldCapacity * sizeof(MapEntry));
+  return 1;
+}
 
-      restoreExpr(1);
-      restoreExpr(2);
-      int begin1 = wpc[1], end1 = wpc[_end(1)], begin2 = wpc[2], end2 = wpc[_end(2)];
-      int shouldOptimize =
-        begin1 + 3 == end1 && tc[begin1 + 1] == Les && begin2 + 2 == end2 &&
-        (tc[begin1] == tc[begin2] && tc[begin2 + 1] == PlusPlus ||
-         tc[begin1] == tc[begin2 + 1] && tc[begin2] == PlusPlus);
+// 広げられなかったら0
+int mapPut(Map *m, intptr_t key, intptr_t value)
+{
+  if (key == MAP_EMPTY) {
+    m->hasEmptyKey = 1;
+    m->emptyKeyValue = value;
+    return 1;
+  }
+  MapEntry *e = findEntry(m, key);
+  if (e->key == MAP_EMPTY) {
+    if ((m->n + 1) * 4 > m->capacity * 3) { // 詰まりすぎないように広げる
+      if (!growMap(m))
+        return 0;
+      e = findEntry(m, key);
+    }
+    e->key = key;
+    ++m->n;
+  }
+  e->value = value;
+  return 1;
+}
+
+// keyがなければ0
+intptr_t mapGet(Map *m, intptr_t key)
+{
+  if (key == MAP_EMPTY)
+    return m->hasEmptyKey ? m->emptyKeyValue : 0;
+  MapEntry *e = findEntry(m, key);
+  return e->key == key ? e->value : 0;
+}
+
+int mapHas(Map *m, intptr_t key)
+{
+  if (key == MAP_EMPTY)
+    return m->hasEmptyKey;
+  return findEntry(m, key)->key == key;
+}
+
+void mapDelete(Map *m, intptr_t key)
+{
+  if (key == MAP_EMPTY) {
+    m->hasEmptyKey = 0;
+    return;
+  }
+  MapEntry *e = findEntry(m, key);
+  if (e->key == MAP_EMPTY)
+    return;
+  intptr_t mask = m->capacity - 1, hole = e - m->entries;
+  for (intptr_t i = (hole + 1) & mask; m->entries[i].key != MAP_EMPTY; i = (i + 1) & mask) {
+    intptr_t home = mapIndex(m, m->entries[i].key);
+    if (((i - home) & mask) >= ((i - hole) & mask)) { // 穴より前に本来の位置があれば詰める
+      m->entries[hole] = m->entries[i];
+      hole = i;
+    }
+  }
+  m->entries[hole].key = MAP_EMPTY;
+  --m->n;
+}
+
+// 組の数
+intptr_t mapSize(Map *m)
+{
+  return m->n + m->hasEmptyKey;
+}
+
+// スナップショット用に、キーと値の組を並べて書き出す
+int writeMap(FILE *fp, Map *m)
+{
+  int err = 0;
+  for (intptr_t i = 0; i < m->capacity && !err; ++i) {
+    if (m->entries[i].key != MAP_EMPTY)
+      err = fwrite(&m->entries[i], sizeof(MapEntry), 1, fp) != 1;
+  }
+  if (m->hasEmptyKey && !err) {
+    MapEntry e = {MAP_EMPTY, m->emptyKeyValue};
+    err = fwrite(&e, sizeof e, 1, fp) != 1;
+  }
+  return err;
+}
+
+/*
+  整列（sort a, n;）
+
+  短い配列はイントロソート（クイックソートが深くなりすぎたらヒープソート）で、
+  長い配列は8ビットずつのLSD基数ソートで並べる。最小値との差をキーにして、最大値との差が収まる桁だけを並べる。
+  各桁では、
+  配列を区間に分けて区間ごとに数え、区間ごとの書き込み位置を決めてから移すので、
+  とても長い配列では区間をスレッドで並列に処理できる（安定なので結果は同じ）。
+*/
+#define INSERTION_SORT_MAX 16
+#define RADIX_SORT_MIN 4096
+#define PARALLEL_SORT_MIN (1 << 20)
+#define MAX_SORT_THREADS 16
+
+inline static void swapInts(intptr_t *a, intptr_t *b)
+{
+  intptr_t t = *a;
+  *a = *b;
+  *b = t;
+}
+
+void insertionSort(intptr_t *a, intptr_t n)
+{
+  for (intptr_t i = 1; i < n; ++i) {
+    intptr_t v = a[i], j;
+    for (j = i; j > 0 && a[j - 1] > v; --j)
+      a[j] = a[j - 1];
+    a[j] = v;
+  }
+}
+
+void siftDown(intptr_t *a, intptr_t i, intptr_t n)
+{
+  for (intptr_t child; (child = i * 2 + 1) < n; i = child) {
+    if (child + 1 < n && a[child + 1] > a[child])
+      ++child;
+    if (a[i] >= a[child])
+      break;
+    swapInts(&a[i], &a[child]);
+  }
+}
+
+void heapSort(intptr_t *a, intptr_t n)
+{
+  for (intptr_t i = n / 2; i > 0; --i)
+    siftDown(a, i - 1, n);
+  for (intptr_t i = n - 1; i > 0; --i) {
+    swapInts(&a[0], &a[i]);
+    siftDown(a, 0, i);
+  }
+}
+
+void introSort(intptr_t *a, intptr_t n, int depth)
+{
+  while (n > INSERTION_SORT_MAX) {
+    if (depth-- == 0) {
+      heapSort(a, n);
+      return;
+    }
+    intptr_t mid = n / 2; // 3つの中央値を軸にする
+    if (a[mid] < a[0])
+      swapInts(&a[mid], &a[0]);
+    if (a[n - 1] < a[0])
+      swapInts(&a[n - 1], &a[0]);
+    if (a[n - 1] < a[mid])
+      swapInts(&a[n - 1], &a[mid]);
+    intptr_t pivot = a[mid], i = 0, j = n - 1;
+    for (;;) {
+      while (a[i] < pivot)
+        ++i;
+      while (pivot < a[j])
+        --j;
+      if (i >= j)
+        break;
+      swapInts(&a[i++], &a[j--]);
+    }
+    if (j + 1 < n - j - 1) { // 短いほうを再帰で、長いほうをループで並べる
+      introSort(a, j + 1, depth);
+      a += j + 1;
+      n -= j + 1;
+    }
+    else {
+      introSort(&a[j + 1], n - j - 1, depth);
+      n = j + 1;
+    }
+  }
+  insertionSort(a, n);
+}
+
+typedef struct {
+  uintptr_t *src, *dst;
+  intptr_t begin, end; // 担当する区間
+  uintptr_t min;
+  int shift;
+  intptr_t count[256]; // 数えた個数、のちに書き込み位置
+} RadixPart;
+
+void *radixCount(void *arg)
+{
+  RadixPart *part = arg;
+  memset(part->count, 0, sizeof part->count);
+  for (intptr_t i = part->begin; i < part->end; ++i)
+    ++part->count[((part->src[i] - part->min) >> part->shift) & 255];
+  return NULL;
+}
+
+void *radixScatter(void *arg)
+{
+  RadixPart *part = arg;
+  for (intptr_t i = part->begin; i < part->end; ++i)
+    part->dst[part->count[((part->src[i] - part->min) >> part->shift) & 255]++] = part->src[i];
+  return NULL;
+}
+
+// 区間ごとにfnを呼ぶ（スレッドを作れなければ自分で呼ぶ）
+void runParts(void *(*fn)(void *), RadixPart *parts, int nParts)
+{
+#if defined(__APPLE__) || defined(__linux__)
+  pthread_t threads[MAX_SORT_THREADS];
+  int isStarted[MAX_SORT_THREADS] = {0};
+  for (int t = 1; t < nParts; ++t)
+    isStarted[t] = pthread_create(&threads[t], NULL, fn, &parts[t]) == 0;
+  for (int t = 0; t < nParts; ++t) {
+    if (isStarted[t])
+      pthread_join(threads[t], NULL);
+    else
+      fn(&parts[t]);
+  }
+#else
+  for (int t = 0; t < nParts; ++t)
+    fn(&parts[t]);
+#endif
+}
 
-      if (shouldOptimize)
-        putIc(OpLop, &vars[curBlock[LoopBegin]], &vars[tc[begin1]], &vars[tc[begin1 + 2]], 0);
-      else {
-        e2 = expression(2);
-        if (begin1 < end1)
-          ifgoto(1, ConditionIsTrue, curBlock[LoopBegin]);
-        else
-          putIc(OpGoto, &vars[curBlock[LoopBegin]], &vars[curBlock[LoopBegin]], 0, 0);
+void radixSort(intptr_t *a, intptr_t *tmp, intptr_t n, int nParts)
+{
+  RadixPart parts[MAX_SORT_THREADS];
+  uintptr_t *src = (uintptr_t *) a, *dst = (uintptr_t *) tmp;
+  intptr_t min = a[0], max = a[0];
+  for (intptr_t i = 1; i < n; ++i) {
+    if (a[i] < min)
+      min = a[i];
+    if (a[i] > max)
+      max = a[i];
+  }
+  uintptr_t range = (uintptr_t) max - (uintptr_t) min;
+  for (int shift = 0; shift < (int) sizeof(uintptr_t) * 8 && range >> shift != 0; shift += 8) {
+    for (int t = 0; t < nParts; ++t) {
+      parts[t].src = src;
+      parts[t].dst = dst;
+      parts[t].begin = n * t / nParts;
+      parts[t].end = n * (t + 1) / nParts;
+      parts[t].min = min;
+      parts[t].shift = shift;
+    }
+    runParts(radixCount, parts, nParts);
+
+    intptr_t pos = 0;
+    int isSame = 0; // すべて同じ桁なら、この桁は移さなくてよい
+    for (int b = 0; b < 256; ++b) {
+      intptr_t total = 0;
+      for (int t = 0; t < nParts; ++t) {
+        intptr_t c = parts[t].count[b];
+        parts[t].count[b] = pos + total;
+        total += c;
       }
-      vars[curBlock[LoopBreak]] = icp - internalCode;
-
-      stopLoop(&loopBlock);
-      curBlock = endBlock();
+      isSame |= total == n;
+      pos += total;
     }
-    else if (match(22, "while (!!**1) {", pc)) { // while文
-      curBlock = beginBlock();
-      curBlock[ BlockType    ] = WhileBlock;
-      curBlock[ LoopBegin    ] = tmpLabelAlloc();
-      curBlock[ LoopContinue ] = tmpLabelAlloc();
-      curBlock[ LoopBreak    ] = tmpLabelAlloc();
-      startLoop(&loopBlock);
+    if (isSame)
+      continue;
+    runParts(radixScatter, parts, nParts);
+    uintptr_t *t = src;
+    src = dst;
+    dst = t;
+  }
+  if (src != (uintptr_t *) a)
+    memcpy(a, src, n * sizeof(intptr_t));
+}
 
-      saveExpr(1);
-      ifgoto(1, ConditionIsFalse, curBlock[LoopBreak]);
-      vars[curBlock[LoopBegin]] = icp - internalCode;
+void sortInts(intptr_t *a, intptr_t n)
+{
+  intptr_t *tmp;
+  if (n >= RADIX_SORT_MIN && (tmp = allocMem(MemSort, n * sizeof(intptr_t))) != NULL) { // 上限を超えるなら作業領域のいらない方で並べる
+    int nParts = 1;
+#if defined(__APPLE__) || defined(__linux__)
+    if (n >= PARALLEL_SORT_MIN) {
+      nParts = sysconf(_SC_NPROCESSORS_ONLN);
+      if (nParts > MAX_SORT_THREADS)
+        nParts = MAX_SORT_THREADS;
+      if (nParts > n / (PARALLEL_SORT_MIN / 4))
+        nParts = n / (PARALLEL_SORT_MIN / 4);
+      if (nParts < 1)
+        nParts = 1;
     }
-    else if (match(12, "}", pc) && curBlock[BlockType] == WhileBlock) {
-      vars[curBlock[LoopContinue]] = icp - internalCode;
+#endif
+    radixSort(a, tmp, n, nParts);
+    freeMem(MemSort, tmp, n * sizeof(intptr_t));
+    return;
+  }
+  int depth = 0;
+  for (intptr_t m = n; m > 1; m >>= 1)
+    depth += 2;
+  introSort(a, n, depth);
+}
 
-      restoreExpr(1);
-      ifgoto(1, ConditionIsTrue, curBlock[LoopBegin]);
-      vars[curBlock[LoopBreak]] = icp - internalCode;
+// 登録されている配列の要素数（見つからなければ0）
+intptr_t arrayLength(intptr_t *p)
+{
+  for (int a = nArrays - 1; a >= 0; --a) {
+    if (arrays[a].p == p)
+      return arrays[a].n;
+  }
+  return 0;
+}
 
-      stopLoop(&loopBlock);
-      curBlock = endBlock();
-    }
-    else if (match(15, "continue;", pc) && loopBlock) {
-      putIc(OpGoto, &vars[loopBlock[LoopContinue]], &vars[loopBlock[LoopContinue]], 0, 0);
-    }
-    else if (match(16, "break;", pc) && loopBlock) {
-      putIc(OpGoto, &vars[loopBlock[LoopBreak]], &vars[loopBlock[LoopBreak]], 0, 0);
-    }
-    else if (match(17, "if (!!**0) continue;", pc) && loopBlock) {
-      ifgoto(0, ConditionIsTrue, loopBlock[LoopContinue]);
-    }
-    else if (match(18, "if (!!**0) break;", pc) && loopBlock) {
-      ifgoto(0, ConditionIsTrue, loopBlock[LoopBreak]);
-    }
-    else if (match(19, "prints !!**0;", pc)) {
-      exprsPutIc(1, OpPrints, 0, &e0);
+/*
+  ファイルを配列として写像する（int a[n] = mmap("file");）
+
+  要素数はファイルの大きさから決まり、ファイルの中身はintptr_tの配列としてそのまま
+  使う。MAP_PRIVATEで写像するので、書き換えたページだけがコピーされてファイルは
+  変わらない。const int a[n]でもPROT_READにはしない（書き込む文はコンパイルエラーに
+  するが、b = a;のように別の変数を通した書き込みで落ちないように）。
+*/
+intptr_t *mapArray(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    printError("Failed to open %s\n", path);
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  intptr_t n = ftell(fp) / sizeof(intptr_t);
+  intptr_t *p = NULL;
+#if defined(__APPLE__) || defined(__linux__)
+  if (n > 0) {
+    p = mmap(NULL, n * sizeof(intptr_t), PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+    if (p == MAP_FAILED)
+      p = NULL;
+    else if (registerArray(p, n) < 0) {
+      munmap(p, n * sizeof(intptr_t));
+      p = NULL;
     }
-    else if (match(20, "int !!*0[!!**2];", pc)) {
-      e2 = expression(2);
-      putIc(OpAryNew, &vars[tc[wpc[0]]], &vars[e2], 0, 0);
+  }
+#endif
+  if (p == NULL) {
+    p = newArray(n);
+    fseek(fp, 0, SEEK_SET);
+    if (p == NULL)
+      memoryLimitExceeded();
+    else if (fread(p, sizeof(intptr_t), n, fp) != n) {
+      printError("Failed to read %s\n", path);
+      p = NULL;
     }
-    else if (match(21, "int !!*0[!!**2] = {", pc)) {
-      e2 = expression(2);
-      putIc(OpAryNew, &vars[tc[wpc[0]]], &vars[e2], 0, 0);
+  }
+  fclose(fp);
+  return p;
+}
 
-      int pc, nElems = 0;
-      for (pc = nextPc; tc[pc] != Rbrace; ++pc) {
-        if (pc >= nTokens)
-          goto err;
-        if (tc[pc] != Comma)
-          ++nElems;
-      }
-      intptr_t *ary = malloc(nElems * sizeof(intptr_t));
-      if (ary == NULL) {
-        printf("Failed to allocate memory\n");
-        exit(1);
-      }
+/*
+  スナップショット
 
-      nElems = 0;
-      for (pc = nextPc; tc[pc] != Rbrace; ++pc) {
-        if (tc[pc] == Comma)
-          continue;
-        ary[nElems] = vars[tc[pc]];
-        ++nElems;
+  「snapshot "file";」を実行すると、その時点のvars[]と、変数から指されている
+  配列と、再開する位置をファイルに書き出す。--resume=fileを付けて同じプログラム
+  を実行すると、コンパイルした後でそれを読み込み、snapshot文の次から再開する。
+
+  配列はページ境界にそろえて書き出しておき、読み込むときはmmap(MAP_PRIVATE)で
+  写像するので、書き換えるまでファイルの内容は複製されない。変数のうち、古い
+  配列の先頭アドレスを持っているものは新しいアドレスに付け替える。
+  文字列リテラルの変数はコンパイルしたときの値のままにする。
+*/
+#define SNAPSHOT_MAGIC "HRBSNAP2"
+
+typedef struct { char magic[8]; int64_t hash, resumeAt, nVars, nArrays; } SnapshotHeader;
+typedef struct { int64_t addr, n, offset, kind; } SnapshotArray; // 可変長配列のnは長さ、連想配列のnはキーと値の組の数の2倍
+
+inline static int64_t alignPage(int64_t offset)
+{
+#if defined(__APPLE__) || defined(__linux__)
+  int64_t pageSize = sysconf(_SC_PAGESIZE);
+#else
+  int64_t pageSize = 4096;
+#endif
+  return (offset + pageSize - 1) / pageSize * pageSize;
+}
+
+int saveSnapshot(const char *path, intptr_t hash, intptr_t resumeAt)
+{
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    printError("Failed to open %s\n", path);
+    return 1;
+  }
+
+  SnapshotArray *table = malloc((nArrays + 1) * sizeof(SnapshotArray));
+  if (table == NULL) {
+    fclose(fp);
+    return 1;
+  }
+  SnapshotHeader header = {SNAPSHOT_MAGIC, hash, resumeAt, nTokenCodes, 0};
+  for (int a = 0; a < nArrays; ++a) { // 変数から指されている配列だけを残す
+    for (int i = 0; i < nTokenCodes; ++i) {
+      if (vars[i] == (intptr_t) arrays[a].p && !isStringSlot(i)) {
+        table[header.nArrays].addr = (intptr_t) arrays[a].p;
+        table[header.nArrays].n = arrays[a].kind == ArrayDynamic ? arrays[a].p[-1] :
+                                  arrays[a].kind == ArrayMap ? mapSize((Map *) arrays[a].p) * 2 : arrays[a].n;
+        table[header.nArrays].kind = arrays[a].kind;
+        ++header.nArrays;
+        break;
       }
-      putIc(OpAryInit, &vars[tc[wpc[0]]], (IntPtr) ary, (IntPtr) nElems, 0);
-      nextPc = pc + 2; // } と ; の分
     }
-    else if (match(8, "!!***0;", pc)) {
-      e0 = expression(0);
+  }
+  int64_t offset = sizeof header + nTokenCodes * sizeof(intptr_t) + header.nArrays * sizeof(SnapshotArray);
+  for (int a = 0; a < header.nArrays; ++a) {
+    offset = alignPage(offset);
+    table[a].offset = offset;
+    offset += table[a].n * sizeof(intptr_t);
+  }
+
+  int err = fwrite(&header, sizeof header, 1, fp) != 1;
+  err |= fwrite(vars, sizeof(intptr_t), nTokenCodes, fp) != nTokenCodes;
+  err |= fwrite(table, sizeof(SnapshotArray), header.nArrays, fp) != header.nArrays;
+  for (int a = 0; a < header.nArrays && !err; ++a) {
+    err |= fseek(fp, table[a].offset, SEEK_SET) != 0;
+    if (table[a].kind == ArrayMap)
+      err |= writeMap(fp, (Map *) table[a].addr) != 0;
+    else
+      err |= fwrite((intptr_t *) table[a].addr, sizeof(intptr_t), table[a].n, fp) != table[a].n;
+  }
+  free(table);
+  err |= fclose(fp) != 0;
+  if (err)
+    printError("Failed to write %s\n", path);
+  return err;
+}
+
+Map *readMap(FILE *fp, SnapshotArray *a)
+{
+  Map *m = newMap();
+  MapEntry e;
+  if (m == NULL || fseek(fp, a->offset, SEEK_SET) != 0)
+    return NULL;
+  for (int64_t i = 0; i < a->n / 2; ++i) {
+    if (fread(&e, sizeof e, 1, fp) != 1 || !mapPut(m, e.key, e.value))
+      return NULL;
+  }
+  return m;
+}
+
+intptr_t *loadSnapshotArray(FILE *fp, SnapshotArray *a)
+{
+  if (a->kind == ArrayMap)
+    return (intptr_t *) readMap(fp, a);
+  if (a->kind == ArrayDynamic) { // 広げられるようにmallocした領域に読み込む
+    intptr_t *p = newDynArray(a->n);
+    if (p == NULL || fseek(fp, a->offset, SEEK_SET) != 0 || fread(p, sizeof(intptr_t), a->n, fp) != a->n)
+      return NULL;
+    return p;
+  }
+#if defined(__APPLE__) || defined(__linux__)
+  if (a->n > 0) {
+    void *p = mmap(NULL, a->n * sizeof(intptr_t), PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), a->offset);
+    if (p == MAP_FAILED)
+      return NULL;
+    if (registerArray(p, a->n) < 0) {
+      munmap(p, a->n * sizeof(intptr_t));
+      return NULL;
     }
-    else {
-      goto err;
+    return p;
+  }
+#endif
+  intptr_t *p = newArray(a->n);
+  if (p == NULL || fseek(fp, a->offset, SEEK_SET) != 0 || fread(p, sizeof(intptr_t), a->n, fp) != a->n)
+    return NULL;
+  return p;
+}
+
+// codeのスナップショットを読み込んで、再開する命令を返す（失敗したらNULL）
+IntPtr *loadSnapshot(const char *path, IntPtr *code, IntPtr *end)
+{
+  SnapshotHeader header;
+  SnapshotArray *table = NULL;
+  intptr_t *saved = NULL, **mapped = NULL, hash = 0;
+  IntPtr *resumeAt = NULL;
+
+  for (IntPtr *ic = code; ic < end; ic += 5) {
+    if ((Opcode) ic[0] == OpSnapshot)
+      hash = (intptr_t) ic[3];
+  }
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    printError("Failed to open %s\n", path);
+    return NULL;
+  }
+  if (fread(&header, sizeof header, 1, fp) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0) {
+    printError("Not a snapshot: %s\n", path);
+    goto exit;
+  }
+  if (header.hash != hash || header.nVars != nTokenCodes || header.resumeAt * 5 >= end - code) {
+    printError("Snapshot does not match the program: %s\n", path);
+    goto exit;
+  }
+  saved = malloc(header.nVars * sizeof(intptr_t));
+  table = malloc((header.nArrays + 1) * sizeof(SnapshotArray));
+  mapped = malloc((header.nArrays + 1) * sizeof(intptr_t *));
+  if (saved == NULL || table == NULL || mapped == NULL ||
+      fread(saved, sizeof(intptr_t), header.nVars, fp) != header.nVars ||
+      fread(table, sizeof(SnapshotArray), header.nArrays, fp) != header.nArrays) {
+    printError("Failed to read %s\n", path);
+    goto exit;
+  }
+  for (int a = 0; a < header.nArrays; ++a) {
+    if ((mapped[a] = loadSnapshotArray(fp, &table[a])) == NULL) {
+      printError("Failed to read %s\n", path);
+      goto exit;
     }
-    tmpFree(e0);
-    tmpFree(e2);
-    if (e0 < 0 || e2 < 0)
-      goto err;
-    pc = nextPc;
   }
-  if (blockDepth > 0) {
-    printf("Block nesting error: blockDepth=%d loopDepth=%d", blockDepth, loopDepth);
+
+  for (int i = 0; i < header.nVars; ++i) {
+    if (isStringSlot(i))
+      continue;
+    vars[i] = saved[i];
+    for (int a = 0; a < header.nArrays; ++a) {
+      if (saved[i] == table[a].addr) {
+        vars[i] = (intptr_t) mapped[a];
+        break;
+      }
+    }
+  }
+  resumeAt = code + header.resumeAt * 5;
+exit:
+  free(saved);
+  free(table);
+  free(mapped);
+  fclose(fp);
+  return resumeAt;
+}
+
+/*
+  整数の入力（input文）
+
+  標準入力を大きなバッファにまとめて読み、空白などで区切られた整数を取り出す。
+  数字が8桁以上続くところは、8バイトを1つの整数として読んでまとめて変換する。
+  See https://lemire.me/blog/2022/01/21/swar-explained-parsing-eight-digits/
+*/
+#define INPUT_BUF_SIZE (1 << 20)
+#define INPUT_MIN_AVAIL 32 // 1つの整数を読む前に、これだけはバッファに入れておく
+
+unsigned char inputBuf[INPUT_BUF_SIZE + 8]; // 8: 8バイトずつ読むときのはみ出し分
+int inputPos, inputEnd, isInputEof;
+
+void fillInput()
+{
+  memmove(inputBuf, &inputBuf[inputPos], inputEnd - inputPos);
+  inputEnd -= inputPos;
+  inputPos = 0;
+  while (inputEnd < INPUT_BUF_SIZE && !isInputEof) {
+#if defined(__APPLE__) || defined(__linux__)
+    ssize_t n = read(0, &inputBuf[inputEnd], INPUT_BUF_SIZE - inputEnd);
+#else
+    int n = fread(&inputBuf[inputEnd], 1, INPUT_BUF_SIZE - inputEnd, stdin);
+#endif
+    if (n <= 0)
+      isInputEof = 1;
+    else
+      inputEnd += n;
+    if (inputEnd >= INPUT_MIN_AVAIL)
+      break;
+  }
+  memset(&inputBuf[inputEnd], 0, 8);
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+inline static int isEightDigits(uint64_t v)
+{
+  return ((v & 0xf0f0f0f0f0f0f0f0) | (((v + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) >> 4)) == 0x3333333333333333;
+}
+
+inline static uint64_t parseEightDigits(uint64_t v)
+{
+  v -= 0x3030303030303030;
+  v = v * 10 + (v >> 8);
+  return ((v & 0x000000ff000000ff) * (100 + (1000000ULL << 32)) +
+          ((v >> 16) & 0x000000ff000000ff) * (1 + (10000ULL << 32))) >> 32;
+}
+#endif
+
+// 次の整数を*vに読み込む（入力が終わっていれば0を返す）
+int readInt(intptr_t *v)
+{
+  for (;;) {
+    if (inputEnd - inputPos < INPUT_MIN_AVAIL && !isInputEof)
+      fillInput();
+    while (inputPos < inputEnd && !isNumber(inputBuf[inputPos]) &&
+           !(inputBuf[inputPos] == '-' && isNumber(inputBuf[inputPos + 1])))
+      ++inputPos;
+    if (inputEnd - inputPos >= INPUT_MIN_AVAIL || (isInputEof && inputPos < inputEnd))
+      break;
+    if (isInputEof)
+      return 0;
+  }
+
+  unsigned char *p = &inputBuf[inputPos];
+  int isNegative = *p == '-';
+  p += isNegative;
+  uintptr_t n = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t eight;
+  while (p + 8 <= &inputBuf[inputEnd] && (memcpy(&eight, p, 8), isEightDigits(eight))) {
+    n = n * 100000000 + parseEightDigits(eight);
+    p += 8;
+  }
+#endif
+  while (isNumber(*p))
+    n = n * 10 + (*p++ - '0');
+  inputPos = p - inputBuf;
+  *v = isNegative ? (intptr_t) (0 - n) : (intptr_t) n;
+  return 1;
+}
+
+/*
+  名前付きの区間の計測（timer "name"; ... stop "name";）
+
+  同じ名前の区間は何度入っても合計する。どの計測器を使うかはコンパイル時に決める。
+  実行が終わったら、計測器があれば一覧を出す（--timers=jsonならJSONで出す）。
+*/
+#define MAX_TIMERS 64
+
+typedef struct {
+  intptr_t name;        // 文字列リテラル
+  int64_t total, count; // 合計[nsec], 計測した回数
+  struct timespec begin;
+  int isRunning;
+} RegionTimer;
+
+RegionTimer timers[MAX_TIMERS];
+int nTimers, isTimerJson;
+
+// 名前がnameの計測器の番号（足りなければ-1）
+int timerIndex(intptr_t name)
+{
+  for (int t = 0; t < nTimers; ++t) {
+    if (timers[t].name == name) // 同じリテラルは同じ場所にある
+      return t;
+  }
+  if (nTimers >= MAX_TIMERS)
     return -1;
+  timers[nTimers].name = name;
+  return nTimers++;
+}
+
+void startTimer(int t)
+{
+  clock_gettime(CLOCK_MONOTONIC, &timers[t].begin);
+  timers[t].isRunning = 1;
+}
+
+void stopTimer(int t)
+{
+  RegionTimer *timer = &timers[t];
+  if (!timer->isRunning)
+    return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timer->total += (now.tv_sec - timer->begin.tv_sec) * 1000000000LL + (now.tv_nsec - timer->begin.tv_nsec);
+  ++timer->count;
+  timer->isRunning = 0;
+}
+
+void reportTimers()
+{
+  char buf[256];
+  int len, isUsed = 0;
+  for (int t = 0; t < nTimers; ++t) {
+    if (timers[t].isRunning) { // 計測中の区間はここまでの時間を足して、計測を続ける
+      stopTimer(t);
+      startTimer(t);
+      --timers[t].count;
+    }
+    isUsed |= timers[t].total > 0 || timers[t].count > 0;
   }
-  putIc(OpEnd, 0, 0, 0, 0);
+  if (!isUsed)
+    return;
 
-  IntPtr *end = icp, *tmpDest;
-  Opcode op;
-  for (icp = internalCode; icp < end; icp += 5) { // goto先の設定
-    op = (Opcode) icp[0];
-    if (OpGoto <= op && op <= OpLop) {
-      tmpDest = internalCode + *icp[1];
-      while ((Opcode) tmpDest[0] == OpGoto) // goto先がOpGotoのときは、さらにその先を読む
-        tmpDest = internalCode + *tmpDest[2];
-      icp[1] = (IntPtr) tmpDest;
+  if (isTimerJson)
+    output("[", 1);
+  else {
+    len = sprintf(buf, "%-20s %10s %14s %14s\n", "timer", "count", "total[sec]", "mean[sec]");
+    output(buf, len);
+  }
+  for (int t = 0; t < nTimers; ++t) {
+    RegionTimer *timer = &timers[t];
+    const char *name = (const char *) timer->name;
+    int nameLen = stringLength(timer->name);
+    if (!isTimerJson) {
+      len = snprintf(buf, sizeof buf, "%-20.*s %10lld %14.9f %14.9f\n", nameLen, name, (long long) timer->count,
+                     timer->total * 1e-9, timer->count ? timer->total * 1e-9 / timer->count : 0.0);
+      output(buf, len);
+      continue;
+    }
+    output(t == 0 ? "\n  {\"name\": \"" : ",\n  {\"name\": \"", t == 0 ? 13 : 14);
+    for (int i = 0; i < nameLen; ++i) { // JSONの文字列としてエスケープする
+      unsigned char ch = name[i];
+      if (ch == '"' || ch == '\\')
+        len = sprintf(buf, "\\%c", ch);
+      else if (ch < ' ')
+        len = sprintf(buf, "\\u%04x", ch);
+      else
+        len = sprintf(buf, "%c", ch);
+      output(buf, len);
     }
+    len = sprintf(buf, "\", \"count\": %lld, \"total_ns\": %lld}", (long long) timer->count, (long long) timer->total);
+    output(buf, len);
   }
-  return end - internalCode;
-err:
-  printf("Syntax error: %s %s %s %s\n", tokenStrs[tc[pc]], tokenStrs[tc[pc + 1]], tokenStrs[tc[pc + 2]], tokenStrs[tc[pc + 3]]);
-  return -1;
+  if (isTimerJson)
+    output("\n]\n", 3);
 }
 
-void exec()
+// 最後に飛んだ先（サンプリング用）
+// icpはexec()の中ではレジスタに置かれるので、シグナルハンドラからは分岐のたびに書くこちらを読む
+IntPtr * volatile sampleIcp;
+
+// 分岐先が後ろなら、使った命令数を数えてから飛ぶ（実行を譲るときは飛んでから返る）
+#define JUMP() \
+  do { \
+    if ((steps -= (intptr_t) icp[4]) < 0 && (status = checkLimits(&steps)) != 0) { \
+      if (status == ExitYield) \
+        icp = (IntPtr *) icp[1]; \
+      return status; \
+    } \
+    sampleIcp = icp = (IntPtr *) icp[1]; \
+  } while (0)
+
+int exec(IntPtr *code)
 {
-  clock_t begin = clock();
-  icp = internalCode;
-  intptr_t i, *a;
+  sampleIcp = icp = code;
+  intptr_t i, *a, steps;
+  int status, len;
+  char buf[64];
+  nSteps = stepsBefore;
+  clock_gettime(CLOCK_MONOTONIC, &execBegin);
+  startSlice(&steps);
   for (;;) {
     switch ((Opcode) icp[0]) {
     case OpEnd:
-      return;
+      countSteps(steps);
+      return ExitSuccess;
     case OpNeg:   *icp[1] = -*icp[2];           icp += 5; continue;
     case OpNot:   *icp[1] = !*icp[2];           icp += 5; continue;
     case OpAdd1:  ++(*icp[1]);                  icp += 5; continue;
     case OpMul:   *icp[1] = *icp[2] *  *icp[3]; icp += 5; continue;
     case OpDiv:   *icp[1] = *icp[2] /  *icp[3]; icp += 5; continue;
     case OpMod:   *icp[1] = *icp[2] %  *icp[3]; icp += 5; continue;
+#if defined(HAS_MUL_HIGH)
+    case OpDivC:  *icp[1] = divByMagic(*icp[2], (intptr_t) icp[3], (intptr_t) icp[4]); icp += 5; continue;
+    case OpModC:
+      i = *icp[2];
+      *icp[1] = i - divByMagic(i, (intptr_t) icp[3], (intptr_t) icp[4]) * ((intptr_t) icp[4] >> 8);
+      icp += 5;
+      continue;
+#endif
     case OpAdd:   *icp[1] = *icp[2] +  *icp[3]; icp += 5; continue;
     case OpSub:   *icp[1] = *icp[2] -  *icp[3]; icp += 5; continue;
     case OpShr:   *icp[1] = *icp[2] >> *icp[3]; icp += 5; continue;
@@ -982,42 +4412,192 @@ void exec()
     case OpCne:   *icp[1] = *icp[2] != *icp[3]; icp += 5; continue;
     case OpBand:  *icp[1] = *icp[2] &  *icp[3]; icp += 5; continue;
     case OpCpy:   *icp[1] = *icp[2];            icp += 5; continue;
+    case OpAddI:  *icp[1] = *icp[2] +  (intptr_t) icp[3]; icp += 5; continue;
+    case OpSubI:  *icp[1] = *icp[2] -  (intptr_t) icp[3]; icp += 5; continue;
+    case OpMulI:  *icp[1] = *icp[2] *  (intptr_t) icp[3]; icp += 5; continue;
+    case OpBandI: *icp[1] = *icp[2] &  (intptr_t) icp[3]; icp += 5; continue;
+    case OpShrI:  *icp[1] = *icp[2] >> (intptr_t) icp[3]; icp += 5; continue;
+    case OpCeqI:  *icp[1] = *icp[2] == (intptr_t) icp[3]; icp += 5; continue;
+    case OpCneI:  *icp[1] = *icp[2] != (intptr_t) icp[3]; icp += 5; continue;
+    case OpCltI:  *icp[1] = *icp[2] <  (intptr_t) icp[3]; icp += 5; continue;
+    case OpCgeI:  *icp[1] = *icp[2] >= (intptr_t) icp[3]; icp += 5; continue;
+    case OpCleI:  *icp[1] = *icp[2] <= (intptr_t) icp[3]; icp += 5; continue;
+    case OpCgtI:  *icp[1] = *icp[2] >  (intptr_t) icp[3]; icp += 5; continue;
     case OpPrint:
-      printf("%d\n", *icp[1]);
+      len = sprintf(buf, "%d\n", (int) *icp[1]);
+      output(buf, len);
+      icp += 5;
+      continue;
+    case OpGoto:                           JUMP(); continue;
+    case OpJeq:  if (*icp[2] == *icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJne:  if (*icp[2] != *icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJle:  if (*icp[2] <= *icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJge:  if (*icp[2] >= *icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJlt:  if (*icp[2] <  *icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJgt:  if (*icp[2] >  *icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJeqI: if (*icp[2] == (intptr_t) icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJneI: if (*icp[2] != (intptr_t) icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJleI: if (*icp[2] <= (intptr_t) icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJgeI: if (*icp[2] >= (intptr_t) icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJltI: if (*icp[2] <  (intptr_t) icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpJgtI: if (*icp[2] >  (intptr_t) icp[3]) { JUMP(); continue; } icp += 5; continue;
+    case OpLopI:
+      i = *icp[2];
+      ++i;
+      *icp[2] = i;
+      if (i < (intptr_t) icp[3]) {
+        JUMP();
+        continue;
+      }
+      icp += 5;
+      continue;
+    case OpTime:
+      len = sprintf(buf, "time: %.3f[sec]\n", execTime());
+      output(buf, len);
+      icp += 5;
+      continue;
+    case OpTimerStart:
+      startTimer((intptr_t) icp[1]);
+      icp += 5;
+      continue;
+    case OpTimerStop:
+      stopTimer((intptr_t) icp[1]);
+      icp += 5;
+      continue;
+    case OpTimerReport:
+      reportTimers();
+      icp += 5;
+      continue;
+    case OpVecMap:
+    case OpVecSum: { // icp[4]: 形 | op << 8 | 1回分の命令数 * 5 << 16
+      intptr_t packed = (intptr_t) icp[4], end = *icp[1] < *icp[2] ? *icp[2] : *icp[1] + 1;
+      i = *icp[1];
+      if ((Opcode) icp[0] == OpVecMap)
+        vecMap(packed & 0xff, (Opcode) (packed >> 8 & 0xff), (intptr_t *) *icp[3], (intptr_t *) *icp[6], *icp[7], i, end);
+      else
+        *icp[3] = vecSum(packed & 0xff, (intptr_t *) *icp[6], (intptr_t *) *icp[7], *icp[3], i, end);
+      *icp[1] = end;
+      icp += 10;
+      if ((steps -= (end - i) * (packed >> 16)) < 0 && (status = checkLimits(&steps)) != 0)
+        return status;
+      continue;
+    }
+    case OpLazy: // 本体をコンパイルしてgotoに書き換えたので、もう一度実行する
+      if (compileLazy(icp) < 0)
+        return ExitFailure;
+      continue;
+    case OpLop:
+      i = *icp[2];
+      ++i;
+      *icp[2] = i;
+      if (i < *icp[3]) {
+        JUMP();
+        continue;
+      }
+      icp += 5;
+      continue;
+    case OpPrints:
+      output((char *) *icp[1], stringLength(*icp[1]) + 1); // 改行まで
+      icp += 5;
+      continue;
+    case OpAryNew:
+      if ((a = newArray(*icp[2])) == NULL)
+        return memoryLimitExceeded();
+      *icp[1] = (intptr_t) a;
+      icp += 5;
+      continue;
+    case OpAryMap:
+      if ((a = mapArray(cString(*icp[2]))) == NULL)
+        return ExitFailure;
+      *icp[1] = (intptr_t) a;
+      icp += 5;
+      continue;
+    case OpAryLen:
+      *icp[1] = arrayLength((intptr_t *) *icp[2]);
       icp += 5;
       continue;
-    case OpGoto:                           icp = (IntPtr *) icp[1]; continue;
-    case OpJeq:  if (*icp[2] == *icp[3]) { icp = (IntPtr *) icp[1]; continue; } icp += 5; continue;
-    case OpJne:  if (*icp[2] != *icp[3]) { icp = (IntPtr *) icp[1]; continue; } icp += 5; continue;
-    case OpJle:  if (*icp[2] <= *icp[3]) { icp = (IntPtr *) icp[1]; continue; } icp += 5; continue;
-    case OpJge:  if (*icp[2] >= *icp[3]) { icp = (IntPtr *) icp[1]; continue; } icp += 5; continue;
-    case OpJlt:  if (*icp[2] <  *icp[3]) { icp = (IntPtr *) icp[1]; continue; } icp += 5; continue;
-    case OpJgt:  if (*icp[2] >  *icp[3]) { icp = (IntPtr *) icp[1]; continue; } icp += 5; continue;
-    case OpTime:
-      printf("time: %.3f[sec]\n", (clock() - begin) / (double) CLOCKS_PER_SEC);
+    case OpSort:
+      sortInts((intptr_t *) *icp[1], *icp[2]);
       icp += 5;
       continue;
-    case OpLop:
+    case OpMapNew:
+      if ((*icp[1] = (intptr_t) newMap()) == 0)
+        return memoryLimitExceeded();
+      icp += 5;
+      continue;
+    case OpMapPut:
+      if (!mapPut((Map *) *icp[1], *icp[2], *icp[3]))
+        return memoryLimitExceeded();
+      icp += 5;
+      continue;
+    case OpMapDel:
+      mapDelete((Map *) *icp[1], *icp[2]);
+      icp += 5;
+      continue;
+    case OpMapGet:
+      *icp[1] = mapGet((Map *) *icp[2], *icp[3]);
+      icp += 5;
+      continue;
+    case OpMapHas:
+      *icp[1] = mapHas((Map *) *icp[2], *icp[3]);
+      icp += 5;
+      continue;
+    case OpAryDyn:
+      if ((*icp[1] = (intptr_t) newDynArray(0)) == 0)
+        return memoryLimitExceeded();
+      icp += 5;
+      continue;
+    case OpPush:
+      a = (intptr_t *) *icp[1];
       i = *icp[2];
-      ++i;
-      *icp[2] = i;
-      if (i < *icp[3]) {
-        icp = (IntPtr *) icp[1];
-        continue;
+      if (a[-1] >= a[-2]) {
+        if ((a = growArray(a, a[-1] + 1)) == NULL)
+          return memoryLimitExceeded();
+        *icp[1] = (intptr_t) a;
       }
+      a[a[-1]++] = i;
       icp += 5;
       continue;
-    case OpPrints:
-      printf("%s\n", (char *) *icp[1]);
+    case OpPop:
+      a = (intptr_t *) *icp[2];
+      *icp[1] = a[-1] > 0 ? a[--a[-1]] : 0;
       icp += 5;
       continue;
-    case OpAryNew:
-      *icp[1] = (intptr_t) malloc(*icp[2] * sizeof(intptr_t));
-      if (*icp[1] == (intptr_t) NULL) {
-        printf("Failed to allocate memory\n");
-        exit(1);
+    case OpDynLen:
+      *icp[1] = ((intptr_t *) *icp[2])[-1];
+      icp += 5;
+      continue;
+    case OpReserve:
+      a = (intptr_t *) *icp[1];
+      if (*icp[2] > a[-2]) {
+        if ((a = growArray(a, *icp[2])) == NULL)
+          return memoryLimitExceeded();
+        *icp[1] = (intptr_t) a;
       }
-      memset((char *) *icp[1], 0, *icp[2] * sizeof(intptr_t));
+      icp += 5;
+      continue;
+    case OpInput:
+      if (!readInt(icp[1]))
+        *icp[1] = 0;
+      icp += 5;
+      continue;
+    case OpInputAry:
+      a = (intptr_t *) *icp[2];
+      for (i = 0; i < *icp[3] && readInt(&a[i]); ++i)
+        ;
+      *icp[1] = i;
+      icp += 5;
+      continue;
+    case OpSnapshot:
+      storeHotVars();
+      if (saveSnapshot(cString(*icp[1]), (intptr_t) icp[3], (intptr_t) icp[2]) != 0)
+        return ExitFailure;
+      icp += 5;
+      continue;
+    case OpAryShare:
+      if ((a = shareArray((Initializer *) icp[2])) == NULL)
+        return memoryLimitExceeded();
+      *icp[1] = (intptr_t) a;
       icp += 5;
       continue;
     case OpAryInit:
@@ -1036,20 +4616,489 @@ void exec()
       *icp[3] = a[i];
       icp += 5;
       continue;
+    case OpArySetI:
+      ((intptr_t *) *icp[1])[(intptr_t) icp[2]] = *icp[3];
+      icp += 5;
+      continue;
+    case OpAryGetI:
+      *icp[3] = ((intptr_t *) *icp[1])[(intptr_t) icp[2]];
+      icp += 5;
+      continue;
+    case OpNop:
+      icp += 5;
+      continue;
     case OpPrm:
-      printf("%s:%s:%d: ", __FILE__, __FUNCTION__, __LINE__);
-      printf("Should not reach here\n");
-      exit(1);
+      printError("%s:%s:%d: Should not reach here\n", __FILE__, __FUNCTION__, __LINE__);
+      return ExitFailure;
     }
   }
 }
 
-int run(String src)
+/*
+  サンプリングによるプロファイラ（--sample=FILE）
+
+  SIGPROFのたびに、実行中の基本ブロック（最後に飛んだ先の命令）を数えておく。実行が終わったら位置の表でソースの行ごとにまとめ、
+  flamegraph.plなどで読めるfolded形式（「スタック 回数」の行）でFILEに書き出す。
+  シグナルハンドラは数を1つ増やすだけなので、実行はほとんど遅くならない。
+*/
+#define SAMPLE_INTERVAL_USEC 1000
+
+const char *samplePath, *sampleName = "repl"; // 書き出すファイル, フレームに付けるスクリプトの名前
+int sampleCounts[sizeof internalCode / sizeof internalCode[0] / 5];
+
+#if defined(__APPLE__) || defined(__linux__)
+void onSample(int sig)
+{
+  IntPtr *p = sampleIcp;
+  if (internalCode <= p && p < internalCode + sizeof internalCode / sizeof internalCode[0])
+    ++sampleCounts[(p - internalCode) / 5];
+}
+
+void setSampling(int isOn)
+{
+  struct itimerval timer = {{0, 0}, {0, 0}};
+  if (isOn) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = onSample;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &sa, NULL);
+    timer.it_interval.tv_usec = timer.it_value.tv_usec = SAMPLE_INTERVAL_USEC;
+  }
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+#else
+void setSampling(int isOn) {}
+#endif
+
+int writeSamples(int nIc)
 {
-  if (compile(src) < 0)
+  FILE *fp = fopen(samplePath, "w");
+  if (fp == NULL) {
+    printf("Failed to open %s\n", samplePath);
     return 1;
-  exec();
-  return 0;
+  }
+  for (int k = 0; k < nIc; ++k) { // 同じ行の命令をまとめる
+    if (sampleCounts[k] == 0)
+      continue;
+    int line = tcLine[icTok[k]], count = 0;
+    for (int j = k; j < nIc; ++j) {
+      if (sampleCounts[j] > 0 && tcLine[icTok[j]] == line) {
+        count += sampleCounts[j];
+        sampleCounts[j] = 0;
+      }
+    }
+    fprintf(fp, "%s;%s:%d %d\n", sampleName, sampleName, line, count);
+  }
+  return fclose(fp) != 0;
+}
+
+/*
+  ハードウェアの性能カウンタ（--perf-counters）
+
+  compile()とexec()のそれぞれの間だけperf_event_openのカウンタを動かし、終了時にまとめて標準エラー出力に出す。
+  開けないカウンタ（コンテナの中などで許されていない、CPUが対応していない）は「n/a」と表示する。
+  HLの命令あたりの値は、exec()が数えた命令数（nStepsの概数）で割ったもの。
+*/
+enum { PerfCycles, PerfInstructions, PerfBranchMisses, PerfL1dMisses, PerfLlcMisses, PerfItlbMisses, EndOfPerfEvents };
+enum { PhaseCompile, PhaseExec, EndOfPhases };
+
+const char *perfEventNames[EndOfPerfEvents] = {"cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses", "iTLB-misses"};
+
+int isPerfCounters, perfFds[EndOfPerfEvents];
+int64_t perfCounts[EndOfPhases][EndOfPerfEvents];
+intptr_t perfSteps; // exec()が実行したHLの命令数の合計
+
+#if defined(__linux__)
+void openPerfCounters()
+{
+  static const struct { uint32_t type; uint64_t config; } events[EndOfPerfEvents] = {
+    [PerfCycles]       = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PerfInstructions] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PerfBranchMisses] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PerfL1dMisses]    = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [PerfLlcMisses]    = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [PerfItlbMisses]   = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  };
+  int nOpened = 0;
+  for (int e = 0; e < EndOfPerfEvents; ++e) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = events[e].type;
+    attr.config = events[e].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perfFds[e] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    nOpened += perfFds[e] >= 0;
+  }
+  if (nOpened == 0)
+    fprintf(stderr, "perf counters are not available (perf_event_open is not permitted or not supported)\n");
+}
+
+inline static void beginPerf()
+{
+  for (int e = 0; isPerfCounters && e < EndOfPerfEvents; ++e) {
+    if (perfFds[e] >= 0) {
+      ioctl(perfFds[e], PERF_EVENT_IOC_RESET, 0);
+      ioctl(perfFds[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+inline static void endPerf(int phase)
+{
+  for (int e = 0; isPerfCounters && e < EndOfPerfEvents; ++e) {
+    int64_t count;
+    if (perfFds[e] >= 0) {
+      ioctl(perfFds[e], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(perfFds[e], &count, sizeof count) == sizeof count)
+        perfCounts[phase][e] += count;
+    }
+  }
+}
+#else
+void openPerfCounters()
+{
+  for (int e = 0; e < EndOfPerfEvents; ++e)
+    perfFds[e] = -1;
+  fprintf(stderr, "perf counters are not available on this platform\n");
+}
+
+inline static void beginPerf() {}
+inline static void endPerf(int phase) {}
+#endif
+
+void reportPerfCounters()
+{
+  if (!isPerfCounters)
+    return;
+  fprintf(stderr, "%-14s %16s %16s %14s\n", "perf counters", "compile", "exec", "per HL insn");
+  for (int e = 0; e < EndOfPerfEvents; ++e) {
+    if (perfFds[e] < 0) {
+      fprintf(stderr, "%-14s %16s %16s %14s\n", perfEventNames[e], "n/a", "n/a", "n/a");
+      continue;
+    }
+    fprintf(stderr, "%-14s %16lld %16lld", perfEventNames[e], (long long) perfCounts[PhaseCompile][e], (long long) perfCounts[PhaseExec][e]);
+    if (perfSteps > 0)
+      fprintf(stderr, " %14.3f\n", (double) perfCounts[PhaseExec][e] / perfSteps);
+    else
+      fprintf(stderr, " %14s\n", "-");
+  }
+  fprintf(stderr, "%-14s", "IPC");
+  for (int phase = 0; phase < EndOfPhases; ++phase) {
+    if (perfFds[PerfCycles] >= 0 && perfFds[PerfInstructions] >= 0 && perfCounts[phase][PerfCycles] > 0)
+      fprintf(stderr, " %16.3f", (double) perfCounts[phase][PerfInstructions] / perfCounts[phase][PerfCycles]);
+    else
+      fprintf(stderr, " %16s", "n/a");
+  }
+  fprintf(stderr, "\n%-14s %16s %16lld\n", "HL insns", "", (long long) perfSteps);
+}
+
+int compileProfiled(String src)
+{
+  beginPerf();
+  int len = compile(src);
+  if (len >= 0 && optLevel > 0)
+    packVars(internalCode, internalCode + len);
+  endPerf(PhaseCompile);
+  return len;
+}
+
+// 指定があれば、サンプリングや性能カウンタの計測をしながら実行する
+int execProfiled(IntPtr *start)
+{
+  if (samplePath) {
+    memset(sampleCounts, 0, sizeof sampleCounts);
+    setSampling(1);
+  }
+  loadHotVars();
+  beginPerf();
+  int status = exec(start);
+  endPerf(PhaseExec);
+  storeHotVars();
+  perfSteps += nSteps;
+  if (samplePath) {
+    setSampling(0);
+    writeSamples((codeEnd - internalCode) / 5);
+  }
+  return status;
+}
+
+int run(String src)
+{
+  int len = compileProfiled(src);
+  if (len < 0)
+    return ExitFailure;
+  return execProfiled(internalCode);
+}
+
+// snapshot文で書き出した状態から実行を再開する
+int resume(String src, const char *snapshotPath)
+{
+  int len = compileProfiled(src);
+  if (len < 0)
+    return ExitFailure;
+  IntPtr *resumeAt = loadSnapshot(snapshotPath, internalCode, internalCode + len);
+  if (resumeAt == NULL)
+    return ExitFailure;
+  return execProfiled(resumeAt);
+}
+
+/*
+  ライブラリとして使うためのAPI（haribote.hを参照）
+
+  hrbCompile()はcompile()の結果をHrbProgramにコピーして、分岐先のアドレスを
+  コピー先に付け替える。被演算子はvars[]を指したままなので、すべての
+  プログラムが変数を共有する。
+
+  hrbSpawn()で作るHrbScriptは、1つのプログラムを自分の変数で実行する文脈で、
+  再開するicpとプログラムが使う変数（prog->slots）の値だけを持つ。hrbResume()は
+  値をvars[]に写してから決めた命令数だけexec()し、終わったら写し戻すので、
+  何千ものスクリプトが内部コードを共有したまま1つのスレッドで交互に動ける。
+  実行した命令数と時間もスクリプトごとに積み上げて、hrbSetLimits()の上限はその合計で調べる。
+*/
+struct HrbProgram {
+  IntPtr *code;
+  int len;
+  int *slots; // 内部コードが使う変数（定数と文字列は除く）
+  int nSlots;
+  Initializer *initializers;
+};
+
+struct HrbScript {
+  HrbProgram *prog;
+  IntPtr *icp;       // 次に実行する命令（終わったらNULL）
+  HrbScript *next;   // スケジューラの待ち行列
+  intptr_t nSteps;   // これまでに実行した命令数
+  double elapsed;    // これまでに実行した時間[sec]
+  intptr_t values[]; // values[k]はvars[prog->slots[k]]の値
+};
+
+struct HrbScheduler {
+  HrbScript *head, *tail; // 準備のできたスクリプト（先頭から順に実行する）
+  intptr_t sliceSteps;
+  HrbDoneFn done;
+  void *ctx;
+  int n;
+};
+
+void initTokens()
+{
+  static int isInitialized = 0;
+  if (!isInitialized) {
+    initTc(defaultTokens, sizeof defaultTokens / sizeof defaultTokens[0]);
+    isInitialized = 1;
+  }
+}
+
+// スクリプトごとに値を持つ変数を集める
+int *collectSlots(IntPtr *code, int len, int *nSlots)
+{
+  char seen[MAX_TOKEN_CODE + 1] = {0};
+  int slots[MAX_TOKEN_CODE + 1], n = 0;
+  for (IntPtr *ic = code; ic < code + len; ic += 5) {
+    for (int i = 1; i <= 4; ++i) {
+      if (!isVarOperand(ic, i))
+        continue;
+      int slot = slotOf(ic[i]);
+      String str = tokenStrs[slot];
+      if (seen[slot] || isStringSlot(slot) || isNumber(str[0]) || str[0] == '-' && isNumber(str[1]))
+        continue;
+      seen[slot] = 1;
+      slots[n++] = slot;
+    }
+  }
+  int *p = malloc((n ? n : 1) * sizeof(int));
+  if (p != NULL)
+    memcpy(p, slots, n * sizeof(int));
+  *nSlots = p != NULL ? n : 0;
+  return p;
+}
+
+HrbProgram *hrbCompile(const char *src)
+{
+  initTokens();
+  int len = compile((String) src);
+  if (len < 0)
+    return NULL;
+
+  HrbProgram *prog = malloc(sizeof(HrbProgram));
+  IntPtr *code = malloc(len * sizeof(IntPtr));
+  if (prog == NULL || code == NULL) {
+    free(prog);
+    free(code);
+    return NULL;
+  }
+  memcpy(code, internalCode, len * sizeof(IntPtr));
+  for (IntPtr *ic = code; ic < code + len; ic += 5) {
+    if (isJump((Opcode) ic[0]))
+      ic[1] = (IntPtr) (code + ((IntPtr *) ic[1] - internalCode));
+  }
+  prog->code = code;
+  prog->len = len;
+  prog->slots = collectSlots(code, len, &prog->nSlots);
+  prog->initializers = initializers; // 初期化子はプログラムと一緒に解放する
+  initializers = NULL;
+  return prog;
+}
+
+int hrbExec(HrbProgram *prog)
+{
+  return exec(prog->code);
+}
+
+void hrbFree(HrbProgram *prog)
+{
+  if (prog == NULL)
+    return;
+  freeInitializers(prog->initializers);
+  free(prog->code);
+  free(prog->slots);
+  free(prog);
+}
+
+void hrbSetVar(const char *name, intptr_t value)
+{
+  initTokens();
+  vars[getTokenCode((String) name, strlen(name))] = value;
+}
+
+intptr_t hrbGetVar(const char *name)
+{
+  initTokens();
+  return vars[getTokenCode((String) name, strlen(name))];
+}
+
+void hrbSetOutput(HrbOutputFn fn, void *ctx)
+{
+  outputFn = fn;
+  outputCtx = ctx;
+}
+
+void hrbSetErrorOutput(HrbOutputFn fn, void *ctx)
+{
+  errorFn = fn;
+  errorCtx = ctx;
+}
+
+void hrbSetLimits(intptr_t maxSteps, double maxSeconds)
+{
+  stepLimit = maxSteps;
+  timeLimit = maxSeconds;
+}
+
+HrbScript *hrbSpawn(HrbProgram *prog)
+{
+  HrbScript *script = calloc(1, sizeof(HrbScript) + prog->nSlots * sizeof(intptr_t));
+  if (script == NULL)
+    return NULL;
+  script->prog = prog;
+  script->icp = prog->code;
+  return script;
+}
+
+int hrbResume(HrbScript *script, intptr_t maxSteps)
+{
+  HrbProgram *prog = script->prog;
+  if (script->icp == NULL)
+    return HRB_OK;
+  for (int k = 0; k < prog->nSlots; ++k)
+    vars[prog->slots[k]] = script->values[k];
+  yieldSteps = maxSteps > 0 ? script->nSteps + maxSteps : 0;
+  stepsBefore = script->nSteps;
+  timeBefore = script->elapsed;
+  int status = exec(script->icp);
+  script->nSteps = nSteps;
+  script->elapsed = execTime();
+  yieldSteps = stepsBefore = 0;
+  timeBefore = 0;
+  for (int k = 0; k < prog->nSlots; ++k)
+    script->values[k] = vars[prog->slots[k]];
+  script->icp = status == ExitYield ? icp : NULL;
+  return status;
+}
+
+// スクリプトの変数の位置（プログラムが使わない変数なら-1）
+int scriptSlot(HrbScript *script, const char *name)
+{
+  initTokens();
+  int slot = getTokenCode((String) name, strlen(name));
+  for (int k = 0; k < script->prog->nSlots; ++k) {
+    if (script->prog->slots[k] == slot)
+      return k;
+  }
+  return -1;
+}
+
+void hrbSetScriptVar(HrbScript *script, const char *name, intptr_t value)
+{
+  int k = scriptSlot(script, name);
+  if (k >= 0)
+    script->values[k] = value;
+}
+
+intptr_t hrbGetScriptVar(HrbScript *script, const char *name)
+{
+  int k = scriptSlot(script, name);
+  return k >= 0 ? script->values[k] : 0;
+}
+
+void hrbKill(HrbScript *script)
+{
+  free(script);
+}
+
+HrbScheduler *hrbNewScheduler(intptr_t sliceSteps, HrbDoneFn done, void *ctx)
+{
+  HrbScheduler *sched = calloc(1, sizeof(HrbScheduler));
+  if (sched == NULL)
+    return NULL;
+  sched->sliceSteps = sliceSteps > 0 ? sliceSteps : 1;
+  sched->done = done;
+  sched->ctx = ctx;
+  return sched;
+}
+
+void hrbSchedule(HrbScheduler *sched, HrbScript *script)
+{
+  script->next = NULL;
+  if (sched->tail != NULL)
+    sched->tail->next = script;
+  else
+    sched->head = script;
+  sched->tail = script;
+  ++sched->n;
+}
+
+// 先頭のスクリプトを1区切りだけ実行して、譲ったら最後に回す
+int hrbStep(HrbScheduler *sched)
+{
+  HrbScript *script = sched->head;
+  if (script == NULL)
+    return 0;
+  sched->head = script->next;
+  if (sched->head == NULL)
+    sched->tail = NULL;
+  --sched->n;
+  int status = hrbResume(script, sched->sliceSteps);
+  if (status == ExitYield)
+    hrbSchedule(sched, script);
+  else if (sched->done != NULL)
+    sched->done(script, status, sched->ctx);
+  return sched->n;
+}
+
+void hrbRunScheduler(HrbScheduler *sched)
+{
+  while (hrbStep(sched) > 0)
+    ;
+}
+
+void hrbFreeScheduler(HrbScheduler *sched)
+{
+  free(sched);
 }
 
 String removeTrailingSemicolon(String str, size_t len)
@@ -1064,14 +5113,73 @@ String removeTrailingSemicolon(String str, size_t len)
   return rv;
 }
 
+/*
+  複数行の入力
+
+  REPLでは中かっこが閉じるまで行をつなげてから、まとめて1回だけコンパイルする。
+*/
+typedef struct { char *str; int len, size; } InputBlock;
+
+// あとlen文字（とNUL）が入るようにする
+void reserveBlock(InputBlock *block, int len)
+{
+  if (block->len + len + 1 > block->size) {
+    int size = block->size ? block->size : 1024;
+    while (size < block->len + len + 1)
+      size *= 2;
+    char *p = realloc(block->str, size);
+    if (p == NULL) {
+      printError("Failed to allocate memory\n");
+      exit(1);
+    }
+    block->str = p;
+    block->size = size;
+  }
+}
+
+void appendBlock(InputBlock *block, const char *str, int len)
+{
+  reserveBlock(block, len);
+  memcpy(&block->str[block->len], str, len);
+  block->len += len;
+  block->str[block->len] = 0;
+}
+
+// 閉じていない中かっこの数（文字列の中は数えない）
+int braceDepth(const char *s)
+{
+  int depth = 0;
+  for (; *s != 0; ++s) {
+    if (*s == '"') {
+      for (++s; *s != 0 && *s != '"' && *s != '\n'; ++s) {
+        if (*s == '\\' && s[1] >= ' ')
+          ++s;
+      }
+      if (*s == 0)
+        break;
+    }
+    else if (*s == '{')
+      ++depth;
+    else if (*s == '}')
+      --depth;
+  }
+  return depth;
+}
+
 #if defined(__APPLE__) || defined(__linux__)
 struct termios initial_term;
+int isBracketedPaste;
 
 void loadHistory();
 
 void initTerm()
 {
   tcgetattr(0, &initial_term);
+  setvbuf(stdin, NULL, _IOFBF, 1 << 16); // 貼り付けを大きな単位で読む
+  if (isatty(0) && isatty(1)) {
+    printf("\e[?2004h"); // bracketed pasteを有効にする
+    isBracketedPaste = 1;
+  }
   loadHistory();
 }
 
@@ -1079,6 +5187,8 @@ void saveHistory();
 
 void destroyTerm()
 {
+  if (isBracketedPaste)
+    printf("\e[?2004l");
   saveHistory();
 }
 
@@ -1201,6 +5311,31 @@ void loadHistory()
   fclose(fp);
 }
 
+InputBlock pasted; // 貼り付けられたテキスト（貼り付け前に打っていた分を含む）
+
+// ESC [ 200 ~ の後から ESC [ 201 ~ までを読む
+int readPaste(FILE *stream, const char *typed, int len)
+{
+  static const char endMark[] = "\e[201~";
+  const int endLen = sizeof endMark - 1;
+  pasted.len = 0;
+  appendBlock(&pasted, typed, len);
+  for (int ch; (ch = getc(stream)) != EOF; ) {
+    reserveBlock(&pasted, 1);
+    pasted.str[pasted.len++] = ch == '\r' ? '\n' : ch;
+    if (ch == '~' && pasted.len - len >= endLen &&
+        memcmp(&pasted.str[pasted.len - endLen], endMark, endLen) == 0) {
+      pasted.len -= endLen;
+      pasted.str[pasted.len] = 0;
+      fwrite(&pasted.str[len], 1, pasted.len - len, stdout); // まとめてエコーする
+      if (pasted.len == 0 || pasted.str[pasted.len - 1] != '\n')
+        putchar('\n');
+      return 0;
+    }
+  }
+  return -1;
+}
+
 char *readLine(char *str, int size, FILE *stream)
 {
   assert(size > 0);
@@ -1287,6 +5422,15 @@ char *readLine(char *str, int size, FILE *stream)
       }
       if ((ch = fgetc(stream)) == EOF)
         break;
+      if (ch == 50) { // Bracketed paste (ESC [ 200 ~)
+        if (fgetc(stream) != '0' || fgetc(stream) != '0' || fgetc(stream) != '~' ||
+            readPaste(stream, str, i) != 0)
+          break;
+        strncpy(str, "__PASTE", 8);
+        cursorX = 0;
+        setCanonicalMode();
+        return str;
+      }
       if (ch == 51) { // Forward Delete
         if ((ch = fgetc(stream)) == EOF || ch != 126) // ~
           break;
@@ -1361,67 +5505,133 @@ char *readLine(char *str, int size, FILE *stream)
 #define readLine fgets
 #endif
 
+#if !defined(HARIBOTE_LIB)
+// 入力を促す。続きの行は「[n]」と同じ幅の「...」で促す
+void printPrompt(int nLines, int isContinued)
+{
+  if (isContinued)
+    printf("%*s> ", snprintf(NULL, 0, "[%d]", nLines), "...");
+  else
+    printf("[%d]> ", nLines);
+}
+
 int main(int argc, const char **argv)
 {
   unsigned char text[10000];
-  initTc(defaultTokens, sizeof defaultTokens / sizeof defaultTokens[0]);
-  if (argc >= 2) {
-    if (loadText((String) argv[1], text, 10000) != 0)
+  initTokens();
+
+  const char *snapshotPath = NULL;
+  int argi;
+  for (argi = 1; argi < argc && argv[argi][0] == '-'; ++argi) {
+    if (strcmp(argv[argi], "-O0") == 0)
+      optLevel = 0;
+    else if (strcmp(argv[argi], "--lazy") == 0)
+      isLazy = 1;
+    else if (strncmp(argv[argi], "--unroll=", 9) == 0)
+      unrollFactor = strtol(&argv[argi][9], NULL, 0);
+    else if (strncmp(argv[argi], "--max-steps=", 12) == 0)
+      stepLimit = strtol(&argv[argi][12], NULL, 0);
+    else if (strncmp(argv[argi], "--max-time=", 11) == 0)
+      timeLimit = strtod(&argv[argi][11], NULL);
+    else if (strncmp(argv[argi], "--resume=", 9) == 0)
+      snapshotPath = &argv[argi][9];
+    else if (strcmp(argv[argi], "--timers=json") == 0)
+      isTimerJson = 1;
+    else if (strncmp(argv[argi], "--sample=", 9) == 0)
+      samplePath = &argv[argi][9];
+    else if (strcmp(argv[argi], "--perf-counters") == 0)
+      isPerfCounters = 1;
+    else if (strcmp(argv[argi], "--mem-report") == 0)
+      isMemReport = 1;
+    else if (strncmp(argv[argi], "--mem-limit=", 12) == 0)
+      memLimit = strtol(&argv[argi][12], NULL, 0);
+    else {
+      printf("Unknown option: %s\n", argv[argi]);
+      exit(1);
+    }
+  }
+  if (isPerfCounters)
+    openPerfCounters();
+  if (argi < argc) {
+    if (loadText((String) argv[argi], text, 10000) != 0)
       exit(1);
-    run(text);
-    exit(0);
+    sampleName = argv[argi];
+    int status = snapshotPath ? resume(text, snapshotPath) : run(text);
+    reportTimers();
+    reportPerfCounters();
+    reportMemory();
+    exit(status);
   }
 
   int status = 0;
+  InputBlock block = {0}; // 中かっこが閉じるまでの入力
   initTerm();
   for (int next = 1, nLines = 0;;) {
-    if (next)
-      printf("[%d]> ", ++nLines);
+    if (next && block.len > 0)
+      printPrompt(nLines, 1);
+    else if (next)
+      printPrompt(++nLines, 0);
     if (readLine(text, LINE_SIZE, stdin) == NULL) {
       printf("\n");
       goto exit;
     }
     int inputLen = strlen(text);
-    if (text[inputLen - 1] == '\n')
+    if (inputLen > 0 && text[inputLen - 1] == '\n')
       text[--inputLen] = 0;
 
     next = 1;
-    String semicolonPos = removeTrailingSemicolon(text, inputLen);
-    if (strcmp(text, "exit") == 0)
-      goto exit;
 #if defined(__APPLE__) || defined(__linux__)
-    else if (strcmp(text, "__PREV_HIST") == 0) {
-      eraseLine();
-      printf("[%d]> ", nLines);
-      showHistory(Prev, text);
-      next = 0;
-    }
-    else if (strcmp(text, "__NEXT_HIST") == 0) {
+    if (strcmp(text, "__PASTE") == 0)
+      appendBlock(&block, pasted.str, pasted.len);
+    else if (strcmp(text, "__PREV_HIST") == 0 || strcmp(text, "__NEXT_HIST") == 0) { // 続きの行でも前の入力を呼び出せる
       eraseLine();
-      printf("[%d]> ", nLines);
-      showHistory(Next, text);
+      printPrompt(nLines, block.len > 0);
+      showHistory(strcmp(text, "__PREV_HIST") == 0 ? Prev : Next, text);
       next = 0;
     }
-#endif
-    else if (strncmp(text, "run ", 4) == 0) {
-      if (loadText(&text[4], text, 10000) != 0)
-        continue;
-      run(text);
-    }
-#if defined(__APPLE__) || defined(__linux__)
-    else if (strcmp(text, "clear") == 0) {
+    else if (block.len > 0 && strcmp(text, "clear") == 0) { // 続きの行でのControl-L
       eraseAll();
-      printf("[%d]> ", nLines);
+      printPrompt(nLines, 1);
       next = 0;
     }
+    else
 #endif
+    if (block.len > 0)
+      appendBlock(&block, text, inputLen);
     else {
-      if (semicolonPos)
-        *semicolonPos = ';';
-      run(text);
+      String semicolonPos = removeTrailingSemicolon(text, inputLen);
+      if (strcmp(text, "exit") == 0)
+        goto exit;
+      else if (strncmp(text, "run ", 4) == 0) {
+        if (loadText(&text[4], text, 10000) == 0)
+          run(text);
+      }
+#if defined(__APPLE__) || defined(__linux__)
+      else if (strcmp(text, "clear") == 0) {
+        eraseAll();
+        printPrompt(nLines, 0);
+        next = 0;
+      }
+#endif
+      else {
+        if (semicolonPos)
+          *semicolonPos = ';';
+        appendBlock(&block, text, strlen(text));
+      }
     }
+    if (block.len == 0)
+      continue;
+    appendBlock(&block, "\n", 1);
+    if (braceDepth(block.str) > 0) // 閉じていなければ続きを読む
+      continue;
+    run(block.str);
+    block.len = 0;
   }
 exit:
+  reportTimers();
+  reportPerfCounters();
+  reportMemory();
   destroyTerm();
   exit(status);
 }
+#endif
@@ -0,0 +1,74 @@
+#!/bin/sh
+# 配列の宣言と最適化を確かめる（既定の最適化と-O0の両方で実行する）
+# 使い方: sh tests/arrays.sh [haribote]  （省略するとmain.cからビルドする）
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+src=$(cd "$(dirname "$0")/.." && pwd)
+hrb=$1
+if [ -z "$hrb" ]; then
+  hrb=$dir/haribote
+  gcc -O2 -w -o "$hrb" "$src/main.c" -lm
+fi
+
+# check 名前 期待する出力 < スクリプト
+check() {
+  cat > "$dir/$1.hl"
+  for opt in "" -O0; do
+    printf "$2" > "$dir/expected"
+    if ! "$hrb" $opt "$dir/$1.hl" > "$dir/out" 2>&1 || ! cmp -s "$dir/expected" "$dir/out"; then
+      echo "$1 $opt: failed"
+      cat "$dir/out"
+      exit 1
+    fi
+  done
+}
+
+# 大きな定数の表（memfdから写像する）は、宣言を実行するたびに別の配列になる
+table=$(seq 1 512 | tr '\n' ',' | sed 's/,$//')
+check table-per-pass '100\n101\n102\n2\n' <<HL
+int keep[3];
+for (k = 0; k < 3; k++) { int t[512] = {$table}; t[0] = 100 + k; keep[k] = t; }
+for (k = 0; k < 3; k++) { c = keep[k]; print c[0]; }
+print c[1];
+HL
+
+# 写像の数の上限を超えてもコピーして続ける
+check table-many-passes '70000\n' <<HL
+s = 0;
+for (k = 0; k < 70000; k++) { int t[512] = {$table}; s = s + t[0]; t[0] = 0; }
+print s;
+HL
+
+# ずらした場所を指す変数との計算は、範囲が重なれば元のループと同じ順に計算する（ポインタの加減算はバイト単位）
+check vec-overlap '39\n0\n26\n' <<HL
+int a[40]; int b[40];
+for (i = 0; i < 40; i++) { a[i] = 1; }
+c = a - 8;
+for (i = 1; i < 39; i++) { a[i] = c[i] + 1; }
+print a[38];
+for (i = 0; i < 40; i++) { a[i] = i; b[i] = 2; }
+for (i = 1; i < 39; i++) { a[i] = c[i]; }
+print a[38];
+for (i = 0; i < 40; i++) { a[i] = i; }
+c = a - 24;
+for (i = 4; i < 39; i++) { a[i] = b[i] + c[i]; }
+print a[38];
+HL
+
+# lenとpopは後ろに可変長配列が続くときだけ演算子で、それ以外はただの変数名
+check len-pop-names '6\n10\n2\n14\n1\n' <<HL
+len = 5;
+print len + 1;
+pop = len * 2;
+print pop;
+int a[];
+push a, 7;
+push a, 9;
+print len a;
+x = pop a + len;
+print x;
+print len a;
+HL
+
+echo "arrays: OK"
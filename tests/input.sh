@@ -0,0 +1,72 @@
+#!/bin/sh
+# inputの整数の読み込みを確かめる（8桁ずつ読む経路、バッファの詰め直し、長すぎる数字の並び）
+# 使い方: sh tests/input.sh [haribote]  （省略するとmain.cからビルドする）
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+src=$(cd "$(dirname "$0")/.." && pwd)
+hrb=$1
+if [ -z "$hrb" ]; then
+  hrb=$dir/haribote
+  gcc -O2 -w -o "$hrb" "$src/main.c" -lm
+fi
+
+# 8桁ずつ読む関数そのもの（リトルエンディアンのときだけ使う）
+cat > "$dir/eight.c" <<'C'
+#include "main.c"
+int main()
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  static const char *digits[] = {"12345678", "00000000", "99999999", "90817263"};
+  static const char *others[] = {"1234567x", "/0000000", ":9999999", "1234 678", "-1234567"};
+  for (int i = 0; i < 4; ++i) {
+    uint64_t v;
+    memcpy(&v, digits[i], 8);
+    if (!isEightDigits(v) || parseEightDigits(v) != strtoull(digits[i], NULL, 10))
+      return printf("not parsed: %s\n", digits[i]), 1;
+  }
+  for (int i = 0; i < 5; ++i) {
+    uint64_t v;
+    memcpy(&v, others[i], 8);
+    if (isEightDigits(v))
+      return printf("parsed: %s\n", others[i]), 1;
+  }
+#endif
+  return 0;
+}
+C
+gcc -O2 -w -DHARIBOTE_LIB -I"$src" -o "$dir/eight" "$dir/eight.c" -lm
+"$dir/eight"
+
+# 1つずつの値（8桁、16桁、18桁、負の数、途中の区切り、8桁の倍数を超える長さ）
+cat > "$dir/values.hl" <<'HL'
+int a[20];
+input a[20], k;
+print k;
+print a[0] == 12345678;
+print a[1] == 0;
+print a[2] == 99999999;
+print a[3] == 0 - 1234567890123456;
+print a[4] == 123456789012345678;
+print a[5] == 7;
+print a[6] == 1234567;
+print a[7] == 89012345;
+print a[8] == 0 - 5999815502254372142;
+print a[9] == 123456789;
+HL
+printf '12345678 00000000 99999999 -1234567890123456 123456789012345678 7 1234567x89012345 1234567890123456789012345678901234567890 123456789' |
+  "$hrb" "$dir/values.hl" > "$dir/out"
+printf '10\n1\n1\n1\n1\n1\n1\n1\n1\n1\n1\n' | cmp - "$dir/out"
+
+# 1MiBのバッファを何度も詰め直す長さの入力
+cat > "$dir/sum.hl" <<'HL'
+int a[1000];
+s = 0; n = 0;
+input a[1000], k;
+while (k > 0) { for (i = 0; i < k; i++) { s = s + a[i]; } n = n + k; input a[1000], k; }
+print n;
+print s == 0 - 4025425934705844928;
+HL
+yes '123456789012345678 -98765432' | head -n 300000 | "$hrb" "$dir/sum.hl" > "$dir/out"
+printf '600000\n1\n' | cmp - "$dir/out"
+echo "input: OK"
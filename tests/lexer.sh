@@ -0,0 +1,55 @@
+#!/bin/sh
+# 長いソースの字句解析を確かめる（スレッドで分けて読んでも、1スレッドで読んだときと同じトークンコードになる）
+# 使い方: sh tests/lexer.sh
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+src=$(cd "$(dirname "$0")/.." && pwd)
+
+cat > "$dir/lexer.c" <<'C'
+#include "main.c"
+int main()
+{
+  // 変数、数、演算子、;や{}を含む文字列、空行やCRLFの行を並べた1MiBほどのソース
+  char *s = malloc(1 << 21);
+  int n = 0;
+  for (int i = 0; n < 1 << 20; ++i)
+    n += sprintf(&s[n], "v%d = v%d + %d; prints \"a; {b} %d\";%s", i % 600, i * 7 % 600, i % 97, i % 13,
+                 i % 5 == 0 ? "\r\n" : i % 3 == 0 ? "\n\n" : "\n");
+  initTokens();
+  int base = nTokenCodes;
+  static const int nThreads[] = {2, 3, 8, MAX_LEX_THREADS};
+  for (int k = 0; k < 4; ++k) {
+    int nTokens = lexerParallel(s, n, nThreads[k]);
+    // 先頭から順に読み直して比べる（新しいトークンは出てきた順に番号が付いていなければならない）
+    int pos = 0, linePos = 0, line = 1, len, i = 0, maxCode = base - 1;
+    for (; (len = nextToken(s, &pos, n)) != 0; pos += len, ++i) {
+      countLines(s, &linePos, pos, &line);
+      int code = tc[i];
+      if (i >= nTokens || len != tokenLens[code] || strncmp(&s[pos], tokenStrs[code], len) != 0 || tcLine[i] != line)
+        return printf("threads=%d: token %d differs\n", nThreads[k], i), 1;
+      if (code > maxCode && code != maxCode + 1)
+        return printf("threads=%d: token %d is numbered out of order\n", nThreads[k], i), 1;
+      if (code > maxCode)
+        maxCode = code;
+    }
+    if (i != nTokens)
+      return printf("threads=%d: %d tokens, expected %d\n", nThreads[k], nTokens, i), 1;
+  }
+
+  // hrbCompile()には長さの上限がないので、長いソースもそのまま並列の字句解析に渡る
+  n = sprintf(s, "s = 0;\n");
+  for (int i = 1; i <= 100; ++i)
+    n += sprintf(&s[n], "s = s + %d;%*s\n", i, 4000, "");
+  HrbProgram *prog = hrbCompile(s);
+  if (prog == NULL || hrbExec(prog) != HRB_OK || hrbGetVar("s") != 5050)
+    return printf("long source: failed\n"), 1;
+  hrbFree(prog);
+  free(s);
+  return 0;
+}
+C
+gcc -O2 -w -DHARIBOTE_LIB -I"$src" -o "$dir/lexer" "$dir/lexer.c" -lm -lpthread
+"$dir/lexer"
+
+echo "lexer: OK"
@@ -0,0 +1,132 @@
+#!/bin/sh
+# ライブラリのAPIを確かめる（スクリプトの実行の上限は、何度も再開した分の合計で調べる。
+# エラーの表示はすべてhrbSetErrorOutput()の関数に送られ、標準出力には何も出さず、プロセスも終わらない）
+# 使い方: sh tests/library.sh
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+src=$(cd "$(dirname "$0")/.." && pwd)
+
+cat > "$dir/host.c" <<'C'
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "haribote.h"
+
+int nDone[5];
+char errors[4096];
+size_t errorsLen;
+
+void onError(const char *str, size_t len, void *ctx)
+{
+  if (errorsLen + len < sizeof errors) {
+    memcpy(&errors[errorsLen], str, len);
+    errorsLen += len;
+  }
+}
+
+// エラーの表示にmessageがあれば消して1を返す
+int hasError(const char *message)
+{
+  int found = strstr(errors, message) != NULL;
+  errorsLen = 0;
+  memset(errors, 0, sizeof errors);
+  return found;
+}
+
+void done(HrbScript *script, int status, void *ctx)
+{
+  ++nDone[status];
+  hrbKill(script);
+}
+
+double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main()
+{
+  hrbSetErrorOutput(onError, NULL);
+  HrbProgram *loop = hrbCompile("L: goto L;");
+  HrbProgram *sum = hrbCompile("s = 0; for (i = 0; i < 5000; i++) { s = s + i; }");
+  if (loop == NULL || sum == NULL)
+    return fprintf(stderr, "compile failed\n"), 1;
+
+  // 1000命令ずつ再開しても、合計で10万命令を超えたら止まる
+  hrbSetLimits(100000, 0);
+  HrbScript *script = hrbSpawn(loop);
+  int nResumes = 0, status;
+  while ((status = hrbResume(script, 1000)) == HRB_YIELD && nResumes < 1000)
+    ++nResumes;
+  if (status != HRB_LIMIT_EXCEEDED || nResumes < 90 || nResumes > 110 || !hasError("Instruction limit exceeded: 100000\n"))
+    return fprintf(stderr, "resume: status %d after %d resumes\n", status, nResumes), 1;
+  hrbKill(script);
+
+  // スケジューラでも同じで、上限はスクリプトごとに数える
+  HrbScheduler *sched = hrbNewScheduler(1000, done, NULL);
+  for (int k = 0; k < 3; ++k) {
+    hrbSchedule(sched, hrbSpawn(loop));
+    script = hrbSpawn(sum);
+    hrbSchedule(sched, script);
+  }
+  int nSteps = 0;
+  while (hrbStep(sched) > 0 && nSteps < 10000)
+    ++nSteps;
+  if (nDone[HRB_LIMIT_EXCEEDED] != 3 || nDone[HRB_OK] != 3 || nSteps > 3 * 110 + 3 * 20)
+    return fprintf(stderr, "scheduler: %d exceeded, %d ok after %d steps\n", nDone[HRB_LIMIT_EXCEEDED], nDone[HRB_OK], nSteps), 1;
+  hrbFreeScheduler(sched);
+
+  // 時間の上限も、区切りごとではなく合計で調べる
+  hrbSetLimits(0, 0.05);
+  script = hrbSpawn(loop);
+  double begin = now();
+  while ((status = hrbResume(script, 1000)) == HRB_YIELD && now() - begin < 10)
+    ;
+  if (status != HRB_LIMIT_EXCEEDED || !hasError("Time limit exceeded"))
+    return fprintf(stderr, "time limit: status %d\n", status), 1;
+  hrbKill(script);
+  hrbSetLimits(0, 0);
+
+  // コンパイルエラーはNULLで知らせて、そのあともコンパイルできる
+  if (hrbCompile("for (") != NULL || !hasError("Syntax error"))
+    return fprintf(stderr, "syntax error: not reported\n"), 1;
+  if (hrbCompile("x = 1 @ 2;") != NULL || !hasError("Lexing error: @ 2;"))
+    return fprintf(stderr, "lexing error: not reported\n"), 1;
+  if (hrbCompile("int a[3]; len a;") != NULL || !hasError("Not a dynamic array: a"))
+    return fprintf(stderr, "dynamic array: not reported\n"), 1;
+  HrbProgram *prog = hrbCompile("t = 6 * 7;");
+  if (prog == NULL || hrbExec(prog) != HRB_OK || hrbGetVar("t") != 42)
+    return fprintf(stderr, "compile after errors: failed\n"), 1;
+  hrbFree(prog);
+
+  // 実行時のエラーはHRB_ERRORで知らせる
+  prog = hrbCompile("int a[1] = mmap(\"no-such-file\");");
+  if (prog == NULL || hrbExec(prog) != HRB_ERROR || !hasError("Failed to open no-such-file"))
+    return fprintf(stderr, "mmap: not reported\n"), 1;
+  hrbFree(prog);
+
+  // トークンの表があふれてもコンパイルエラーになるだけ（表はプロセスで1つなので最後に試す）
+  char src[20000];
+  int n = 0;
+  for (int i = 0; i < 1100; ++i)
+    n += sprintf(&src[n], "v%d = %d; ", i, i);
+  if (hrbCompile(src) != NULL || !hasError("Too many tokens"))
+    return fprintf(stderr, "too many tokens: not reported\n"), 1;
+
+  hrbFree(loop);
+  hrbFree(sum);
+  return 0;
+}
+C
+gcc -O2 -w -DHARIBOTE_LIB -I"$src" -o "$dir/host" "$dir/host.c" "$src/main.c" -lm -lpthread
+"$dir/host" > "$dir/out"
+if [ -s "$dir/out" ]; then
+  echo "library: wrote to stdout"
+  cat "$dir/out"
+  exit 1
+fi
+
+echo "library: OK"